@@ -0,0 +1,202 @@
+/*
+ * helper_bench.c @ MoyOS
+ *
+ * Compare memcpy, memset and strcpy of helper.c with the byte loops
+ * they replaced. Takes the place of user_main.c, see "make bench".
+ * Cycles are read from the port's cycle counter and printed through
+ * semihosting, so run it on a board or under a debugger.
+ *
+ */
+#include "moyos.h"
+#include "helper.h"
+#include "user_main.h"
+#include <stdio.h>
+
+#define BENCH_MAX_SIZE 4096
+#define BENCH_ROUNDS 8
+
+static uint8_t src_buf[BENCH_MAX_SIZE + 8] __attribute__((aligned(8)));
+static uint8_t dst_buf[BENCH_MAX_SIZE + 8] __attribute__((aligned(8)));
+
+static const uint32_t sizes[] = {
+    1, 3, 4, 7, 8, 15, 16, 31, 32, 64, 100, 128, 256, 512, 1024, 2048, 4096
+};
+
+/* Byte loops as they were before. */
+static void* ByteMemcpy(void *destination, const void *source, uint32_t num)
+{
+    unsigned char *dst = destination;
+    const unsigned char *src = source;
+    while (num--) {
+        *(dst++) = *(src++);
+    }
+    return destination;
+}
+
+static void* ByteMemset(void *destination, int value, uint32_t n)
+{
+    const unsigned char v = (unsigned char)value;
+    unsigned char *dst;
+    for(dst = destination; n > 0; ++dst, --n)
+        *dst = v;
+    return destination;
+}
+
+static char* ByteStrcpy(char *destination, const char *source)
+{
+    char *rt = destination;
+    while (*source != '\0') {
+        *(destination++) = *(source++);
+    }
+    *destination = '\0';
+    return rt;
+}
+
+typedef enum {
+    BENCH_MEMCPY,
+    BENCH_MEMSET,
+    BENCH_STRCPY,
+} BENCH_KIND;
+
+/*
+ * Run one copy or fill some rounds and return the fewest cycles.
+ * The source and destination offsets give the misaligned cases.
+ */
+static uint32_t Measure(BENCH_KIND kind, uint8_t optimized,
+                        uint32_t size, uint8_t dst_off, uint8_t src_off)
+{
+    uint8_t *dst = dst_buf + dst_off;
+    uint8_t *src = src_buf + src_off;
+    uint32_t best = ~0u;
+    uint8_t round;
+
+    if (kind == BENCH_STRCPY) {
+        ByteMemset(src, 'x', size - 1);
+        src[size - 1] = '\0';
+    }
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        uint32_t start = _moyCycleCount();
+        switch (kind) {
+            case BENCH_MEMCPY:
+                optimized ? memcpy(dst, src, size) : ByteMemcpy(dst, src, size);
+                break;
+            case BENCH_MEMSET:
+                optimized ? memset(dst, round, size) : ByteMemset(dst, round, size);
+                break;
+            case BENCH_STRCPY:
+                optimized ? strcpy((char *)dst, (char *)src)
+                          : ByteStrcpy((char *)dst, (char *)src);
+                break;
+        }
+        uint32_t cycles = _moyCycleCount() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    return best;
+}
+
+/*
+ * Compare dst_buf with expect, after both were written the same way.
+ */
+static uint8_t Same(const char *name, uint8_t *expect, uint32_t size,
+                    uint8_t dst_off, uint8_t src_off)
+{
+    uint32_t j;
+    for (j = 0; j < sizeof(dst_buf); j++) {
+        if (dst_buf[j] != expect[j]) {
+            printf("%s %lu %d/%d wrong at %lu\n", name, size, dst_off, src_off, j);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Check the results against the byte loops, over every alignment.
+ * Strings end at every offset of a word, and the bytes after the
+ * terminator must stay as they were.
+ */
+static uint8_t Verify()
+{
+    static uint8_t expect[BENCH_MAX_SIZE + 8];
+    static const uint32_t lengths[] = {0, 1, 2, 3, 4, 5, 6, 7, 32, 33, 34, 35, 36, 37, 38, 39};
+    uint32_t i;
+    uint8_t dst_off, src_off;
+
+    for (i = 0; i < sizeof(src_buf); i++) {
+        src_buf[i] = (uint8_t)(i * 7 + 1);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (dst_off = 0; dst_off < 4; dst_off++) {
+            for (src_off = 0; src_off < 4; src_off++) {
+                uint32_t size = sizes[i];
+                ByteMemset(dst_buf, 0, sizeof(dst_buf));
+                ByteMemset(expect, 0, sizeof(expect));
+                memcpy(dst_buf + dst_off, src_buf + src_off, size);
+                ByteMemcpy(expect + dst_off, src_buf + src_off, size);
+                if (!Same("memcpy", expect, size, dst_off, src_off)) {
+                    return 0;
+                }
+                memset(dst_buf + dst_off, 0x5C, size);
+                ByteMemset(expect + dst_off, 0x5C, size);
+                if (!Same("memset", expect, size, dst_off, src_off)) {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    /* Non-zero bytes, then the terminator and more bytes past it. */
+    for (i = 0; i < sizeof(src_buf); i++) {
+        src_buf[i] = (uint8_t)(i % 251 + 1);
+    }
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        for (dst_off = 0; dst_off < 8; dst_off++) {
+            for (src_off = 0; src_off < 8; src_off++) {
+                uint32_t length = lengths[i];
+                char *src = (char *)src_buf + src_off;
+                src[length] = '\0';
+                ByteMemset(dst_buf, 0xEE, sizeof(dst_buf));
+                ByteMemset(expect, 0xEE, sizeof(expect));
+                strcpy((char *)dst_buf + dst_off, src);
+                ByteStrcpy((char *)expect + dst_off, src);
+                src[length] = (char)((src_off + length) % 251 + 1);
+                if (!Same("strcpy", expect, length, dst_off, src_off)) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+void user_main()
+{
+    setbuf(stdout, NULL);
+
+    if (!Verify()) {
+        for (;;);
+    }
+
+    static const char *names[] = {"memcpy", "memset", "strcpy"};
+    BENCH_KIND kind;
+    uint8_t i;
+    for (kind = BENCH_MEMCPY; kind <= BENCH_STRCPY; kind++) {
+        printf("%s (cycles)\n", names[kind]);
+        printf("%6s %8s %8s %8s %8s\n", "size", "byte", "word", "byte+1", "word+1");
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            uint32_t size = sizes[i];
+            if (kind == BENCH_STRCPY && size < 2) {
+                continue;
+            }
+            printf("%6lu %8lu %8lu %8lu %8lu\n", size,
+                   Measure(kind, 0, size, 0, 0),
+                   Measure(kind, 1, size, 0, 0),
+                   Measure(kind, 0, size, 1, 0),
+                   Measure(kind, 1, size, 1, 0));
+        }
+    }
+    printf("done\n");
+    for (;;);
+}
@@ -0,0 +1,49 @@
+/*
+ * sim.h @ MoyOS # Host Simulator
+ *
+ * Virtual clock and event source of the simulator, for workloads.
+ *
+ */
+#ifndef MOYOS_SIM_H
+#define MOYOS_SIM_H
+
+#include "moyos.h"
+
+/* Virtual CPU cycles in one tick. */
+#define SIM_TICK_CYCLES (_moyCycleFrequency() / 1000 * MOY_SWITCH_INTERVAL)
+
+/* Cycles charged for each context switch. */
+#define SIM_SWITCH_CYCLES 200u
+
+/* Number of log2 buckets in the latency histogram. */
+#define SIM_LATENCY_BUCKETS 40
+
+typedef void(*SimEvent)(void *arg);
+
+typedef struct {
+    uint64_t ticks;                 /* ticks delivered */
+    uint64_t cycles;                /* virtual cycles elapsed */
+    uint64_t switches;              /* switches to another task */
+    uint64_t wakeups;               /* tasks made ready */
+    uint64_t tick_ns;               /* host time spent in _moyTick */
+    uint64_t tick_ns_max;           /* worst host time of one _moyTick */
+    uint64_t switch_ns;             /* host time spent in _moySwitch */
+    uint64_t latency_count;         /* wakeups that ran */
+    uint64_t latency_sum;           /* their total latency (cycles) */
+    uint64_t latency_max;           /* worst latency (cycles) */
+    uint64_t latency[SIM_LATENCY_BUCKETS];  /* bucket i: [2^(i-1), 2^i) cycles */
+} SimStats;
+
+/* Run the kernel from moyStart until a number of ticks has passed. */
+void simSetTickLimit(uint64_t ticks);
+
+/* Call fn(arg) in handler mode every period ticks, from tick first on. */
+void simEvery(uint64_t first, uint64_t period, SimEvent fn, void *arg);
+
+/* Keep the virtual CPU busy for some cycles, letting ticks preempt. */
+void simBusy(uint64_t cycles);
+
+/* Statistics gathered so far. */
+const SimStats *simStats();
+
+#endif //MOYOS_SIM_H
@@ -0,0 +1,25 @@
+/*
+ * sim_config.h @ MoyOS # Host Simulator
+ *
+ * Configurations of the simulator build: those of the target, with room
+ * for a thousand tasks and more.
+ *
+ */
+#ifndef MOYOS_SIM_CONFIG_H
+#define MOYOS_SIM_CONFIG_H
+
+#include "config.h"
+
+/* Size of Memory Pool for Stack and Malloc (words) */
+#undef MOY_POOL_SIZE
+#define MOY_POOL_SIZE (1 << 18)
+
+/* Maximum Task Number */
+#undef MOY_TASK_SIZE
+#define MOY_TASK_SIZE 4096
+
+/* Maximum Queue Number */
+#undef MOY_QUEUE_SIZE
+#define MOY_QUEUE_SIZE 200
+
+#endif //MOYOS_SIM_CONFIG_H
@@ -0,0 +1,208 @@
+/*
+ * sim_main.c @ MoyOS # Host Simulator
+ *
+ * Scaling study of the scheduler: many tasks sleeping, computing and
+ * passing items through queues, while interrupts push into the queues.
+ * Runs are deterministic for a given seed, the host times aside.
+ *
+ * Usage: build/moysim [tasks] [ticks] [queues] [seed]
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sim.h"
+
+enum SIM_KIND {
+    SIM_SLEEPER,
+    SIM_PRODUCER,
+    SIM_CONSUMER
+};
+
+typedef struct {
+    uint32_t seed;                  /* state of the task's own generator */
+    uint8_t kind;
+    uint8_t queue;
+} SimTask;
+
+static uint8_t queue_ids[MOY_QUEUE_SIZE];
+static uint8_t queue_size = 64;
+static uint8_t irq_queue = 0;
+static uint64_t irq_pushes = 0;
+static uint64_t irq_drops = 0;
+
+static uint32_t Random(uint32_t *seed)
+{
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+static uint32_t Between(uint32_t *seed, uint32_t low, uint32_t high)
+{
+    return low + Random(seed) % (high - low + 1);
+}
+
+static void TaskBody(SimTask *task)
+{
+    moy_size item = 0;
+    for (;;) {
+        switch (task->kind) {
+            case SIM_SLEEPER:
+                simBusy(Between(&task->seed, 200, 2000));
+                if (Between(&task->seed, 0, 7) == 0) {
+                    moyDelayUs(Between(&task->seed, 20, 900));
+                } else {
+                    moyDelay(Between(&task->seed, 8, 256));
+                }
+                break;
+            case SIM_PRODUCER:
+                simBusy(Between(&task->seed, 200, 2000));
+                moyDelay(Between(&task->seed, 8, 128));
+                moyQueuePush(queue_ids[task->queue], item++, 20);
+                break;
+            case SIM_CONSUMER:
+                if (moyQueuePull(queue_ids[task->queue], &item, 200) == QUEUE_OK) {
+                    simBusy(Between(&task->seed, 100, 1000));
+                }
+                break;
+        }
+    }
+}
+
+/*
+ * Interrupt event: push into the queues in turn, never waiting.
+ */
+static void IrqPush(void *arg)
+{
+    if (moyQueuePush(queue_ids[irq_queue], irq_pushes, 0) == QUEUE_OK) {
+        irq_pushes++;
+    } else {
+        irq_drops++;
+    }
+    irq_queue = (irq_queue + 1) % queue_size;
+}
+
+/*
+ * Upper bound of the bucket holding some fraction of the latencies.
+ */
+static uint64_t Percentile(const SimStats *stats, double fraction)
+{
+    uint64_t target = (uint64_t)(stats->latency_count * fraction);
+    uint64_t seen = 0;
+    uint8_t i;
+    for (i = 0; i < SIM_LATENCY_BUCKETS; ++i) {
+        seen += stats->latency[i];
+        if (seen > target) {
+            return i == 0 ? 0 : (1ull << i) - 1;
+        }
+    }
+    return stats->latency_max;
+}
+
+static void Report(moy_size task_size, double host_seconds)
+{
+    const SimStats *stats = simStats();
+    double ticks = stats->ticks ? (double)stats->ticks : 1;
+    double cycles_per_us = SIM_TICK_CYCLES / (1000.0 * MOY_SWITCH_INTERVAL);
+
+    printf("tasks %lu, queues %u, ticks %llu (%.1f s virtual) in %.2f s host\n",
+           (unsigned long)task_size, queue_size, (unsigned long long)stats->ticks,
+           stats->cycles / cycles_per_us / 1e6, host_seconds);
+    printf("switches %llu (%.2f per tick), wakeups %llu (%.2f per tick)\n",
+           (unsigned long long)stats->switches, stats->switches / ticks,
+           (unsigned long long)stats->wakeups, stats->wakeups / ticks);
+    printf("irq pushes %llu, dropped %llu\n",
+           (unsigned long long)irq_pushes, (unsigned long long)irq_drops);
+    printf("_moyTick %.0f ns mean, %llu ns worst; _moySwitch %.0f ns mean (host)\n",
+           stats->tick_ns / ticks, (unsigned long long)stats->tick_ns_max,
+           stats->switches ? (double)stats->switch_ns / stats->switches : 0.0);
+
+    if (stats->latency_count == 0) return;
+    printf("wake latency (us): mean %.1f, p50 < %.1f, p90 < %.1f, p99 < %.1f, max %.1f\n",
+           (double)stats->latency_sum / stats->latency_count / cycles_per_us,
+           Percentile(stats, 0.5) / cycles_per_us,
+           Percentile(stats, 0.9) / cycles_per_us,
+           Percentile(stats, 0.99) / cycles_per_us,
+           stats->latency_max / cycles_per_us);
+    uint8_t i;
+    for (i = 0; i < SIM_LATENCY_BUCKETS; ++i) {
+        if (stats->latency[i] == 0) continue;
+        printf("  < %12llu cycles %12llu (%5.1f%%)\n",
+               (unsigned long long)(1ull << i), (unsigned long long)stats->latency[i],
+               100.0 * stats->latency[i] / stats->latency_count);
+    }
+}
+
+/*
+ * Read argument i as a number, or take a default if it is not given.
+ * Return 0 if it is not a number.
+ */
+static uint8_t Argument(int argc, char **argv, int i, unsigned long long *value)
+{
+    if (argc <= i) return 1;
+    char *end;
+    errno = 0;
+    *value = strtoull(argv[i], &end, 0);
+    return end != argv[i] && *end == '\0' && errno == 0 && argv[i][0] != '-';
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long tasks = 1000, ticks = 1000000, queues = 64, seed = 1;
+    if (!Argument(argc, argv, 1, &tasks) || !Argument(argc, argv, 2, &ticks)
+            || !Argument(argc, argv, 3, &queues) || !Argument(argc, argv, 4, &seed)
+            || argc > 5) {
+        fprintf(stderr, "usage: %s [tasks] [ticks] [queues] [seed]\n", argv[0]);
+        return 1;
+    }
+    if (tasks == 0 || tasks > MOY_TASK_SIZE || queues == 0 || queues > MOY_QUEUE_SIZE) {
+        fprintf(stderr, "1 to %d tasks and 1 to %d queues\n", MOY_TASK_SIZE, MOY_QUEUE_SIZE);
+        return 1;
+    }
+    moy_size task_size = (moy_size)tasks;
+    queue_size = (uint8_t)queues;
+    seed = (uint32_t)seed;
+    if (seed == 0) seed = 1;
+
+    _moyInit();
+    uint8_t i;
+    for (i = 0; i < queue_size; ++i) {
+        moyCreateQueue(queue_ids + i);
+    }
+
+    /* Half sleepers, the rest producers and consumers paired on queues. */
+    static const uint8_t priorities[] = {1, 2, 3, 5, 6};
+    SimTask *sim_tasks = calloc(task_size, sizeof(SimTask));
+    moy_size t;
+    for (t = 0; t < task_size; ++t) {
+        SimTask *task = sim_tasks + t;
+        task->seed = seed + (uint32_t)t * 2654435761u;
+        if (task->seed == 0) task->seed = 1;
+        task->kind = t % 4 < 2 ? SIM_SLEEPER : t % 4 == 2 ? SIM_PRODUCER : SIM_CONSUMER;
+        task->queue = (t / 4) % queue_size;
+
+        char name[MOY_TASK_NAME_SIZE];
+        snprintf(name, sizeof(name), "t%lu", (unsigned long)t);
+        uint8_t result = moyCreateTask((TaskFunction)TaskBody, name, 32, task,
+                                       priorities[t % 5], 0);
+        if (result != TASK_OK) {
+            fprintf(stderr, "task %lu not created: %u\n", (unsigned long)t, result);
+            return 1;
+        }
+    }
+    simEvery(1, 5, IrqPush, 0);
+    simSetTickLimit(ticks);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    moyStart();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    Report(task_size, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
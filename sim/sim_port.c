@@ -0,0 +1,478 @@
+/*
+ * sim_port.c @ MoyOS # Host Simulator
+ *
+ * Port functions for a host process. Each frame the kernel switches to
+ * is run by a host coroutine with a stack of its own. The virtual CPU
+ * takes interrupts whenever PRIMASK is clear and no handler is running:
+ * PendSV is taken last, right where the target would take it.
+ *
+ * Contexts are recycled when a task returns or a preempting job resumes
+ * the job below it. Those of tasks deleted by others are not.
+ *
+ */
+/* Checked longjmp refuses to move between stacks, which is the point here. */
+#undef _FORTIFY_SOURCE
+#define _XOPEN_SOURCE 700
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include "sim.h"
+
+/* Host stack of each coroutine, far more than the kernel needs. */
+#define SIM_STACK_BYTES (64 * 1024)
+
+/* Maximum number of periodic events. */
+#define SIM_EVENT_SIZE 32
+
+typedef struct SimContext {
+    ucontext_t start;               /* entry of a fresh coroutine */
+    jmp_buf resume;                 /* where it was switched out */
+    uint8_t started;
+    struct SimContext *next_free;
+    char stack[SIM_STACK_BYTES];
+} SimContext;
+
+/* A stack top: saved registers, then the exception frame. */
+typedef struct {
+    MoyFrame saved;
+    AutoFrame auto_frame;
+} SimFrame;
+
+typedef struct {
+    SimEvent fn;
+    void *arg;
+    uint64_t next;
+    uint64_t period;
+} SimEventEntry;
+
+/* Coroutines. */
+static SimContext *running = 0;
+static SimContext *dying = 0;
+static SimContext *free_contexts = 0;
+static moy_size running_frame = 0;
+static jmp_buf main_resume;
+
+/* Virtual CPU. */
+static uint64_t now = 0;
+static uint64_t next_tick_at = SIM_TICK_CYCLES;
+static uint64_t timer_at = UINT64_MAX;
+static uint64_t tick_limit = 1000;
+static uint32_t primask = 0;
+static uint8_t in_handler = 0;
+static uint8_t pendsv = 0;
+static uint32_t irq_pending = 0;
+
+/* Event source. */
+static SimEventEntry events[SIM_EVENT_SIZE];
+static uint8_t event_count = 0;
+
+/* Statistics, and when each ready task was made ready (cycles + 1). */
+static SimStats stats;
+static uint64_t ready_at[MOY_STATIC_TASK_COUNT + MOY_TASK_SIZE];
+
+static uint64_t HostNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * Give back the context of a coroutine that will never run again.
+ * Done by whoever runs next, as a coroutine can't free itself.
+ */
+static void Reap()
+{
+    if (dying != 0 && dying != running) {
+        dying->next_free = free_contexts;
+        free_contexts = dying;
+        dying = 0;
+    }
+}
+
+static void Trampoline();
+
+static SimContext *NewContext()
+{
+    SimContext *context = free_contexts;
+    if (context != 0) {
+        free_contexts = context->next_free;
+    } else {
+        context = malloc(sizeof(SimContext));
+        if (context == 0) {
+            fprintf(stderr, "sim: out of host memory\n");
+            exit(1);
+        }
+    }
+    context->started = 0;
+    getcontext(&context->start);
+    context->start.uc_stack.ss_sp = context->stack;
+    context->start.uc_stack.ss_size = SIM_STACK_BYTES;
+    context->start.uc_link = 0;
+    makecontext(&context->start, Trampoline, 0);
+    return context;
+}
+
+/*
+ * Get the coroutine of a frame, creating it on the first switch.
+ */
+static SimContext *FrameContext(moy_size stack_top)
+{
+    SimFrame *frame = (SimFrame *)stack_top;
+    if (frame->saved.context == 0) {
+        frame->saved.context = (moy_size)NewContext();
+    }
+    return (SimContext *)frame->saved.context;
+}
+
+/*
+ * Run the entry of a frame, then its return address as lr would.
+ */
+static void Trampoline()
+{
+    Reap();
+    SimFrame *frame = (SimFrame *)running_frame;
+    TaskFunction entry = (TaskFunction)frame->auto_frame.pc;
+    void (*exit_to)() = (void (*)())frame->auto_frame.lr;
+    entry((void *)frame->auto_frame.r0);
+
+    dying = running;
+    if (exit_to != 0) {
+        exit_to();
+    }
+    fprintf(stderr, "sim: a frame without return address returned\n");
+    abort();
+}
+
+/*
+ * Leave the running coroutine for another.
+ * Uses plain jumps once started, so no signal mask syscall per switch.
+ */
+static void SwitchTo(SimContext *to)
+{
+    SimContext *from = running;
+    running = to;
+    if (_setjmp(from->resume) == 0) {
+        if (to->started) {
+            _longjmp(to->resume, 1);
+        }
+        to->started = 1;
+        setcontext(&to->start);
+    }
+    Reap();
+}
+
+/*
+ * PendSV: ask the kernel for the next frame and switch to it.
+ */
+static void DoSwitch()
+{
+    pendsv = 0;
+    in_handler++;
+    uint64_t start = HostNs();
+    moy_size next = _moySwitch(running_frame);
+    stats.switch_ns += HostNs() - start;
+    in_handler--;
+    if (next == running_frame) return;
+
+    stats.switches++;
+    now += SIM_SWITCH_CYCLES;
+    running_frame = next;
+    SwitchTo(FrameContext(next));
+}
+
+/*
+ * Take what is pending once interrupts may come: IRQ lines, then PendSV.
+ * Lines are taken in number order, without nesting.
+ */
+static void TakeInterrupts()
+{
+    if (in_handler || primask) return;
+    while (irq_pending != 0) {
+        uint8_t irq = __builtin_ctz(irq_pending);
+        irq_pending &= ~(1u << irq);
+        in_handler++;
+        _moyIrqTaskRun(irq);
+        in_handler--;
+    }
+    if (pendsv) {
+        DoSwitch();
+    }
+}
+
+/*
+ * Back to the caller of moyStart, from whichever coroutine runs.
+ */
+static void Finish()
+{
+    stats.cycles = now;
+    _longjmp(main_resume, 1);
+}
+
+/*
+ * SysTick: tick the kernel, then fire the events due.
+ */
+static void Tick()
+{
+    next_tick_at += SIM_TICK_CYCLES;
+    stats.ticks++;
+
+    in_handler++;
+    uint64_t start = HostNs();
+    _moyTick();
+    uint64_t spent = HostNs() - start;
+    stats.tick_ns += spent;
+    if (spent > stats.tick_ns_max) {
+        stats.tick_ns_max = spent;
+    }
+    uint8_t i;
+    for (i = 0; i < event_count; ++i) {
+        if (events[i].next <= stats.ticks) {
+            events[i].next += events[i].period;
+            events[i].fn(events[i].arg);
+        }
+    }
+    in_handler--;
+
+    if (stats.ticks >= tick_limit) {
+        Finish();
+    }
+    _moyYield();
+}
+
+/*
+ * Precise timer match: wake the sleepers due, then switch if asked.
+ */
+static void TimerMatch()
+{
+    timer_at = UINT64_MAX;
+    in_handler++;
+    _moyTimerExpired();
+    in_handler--;
+    TakeInterrupts();
+}
+
+/*
+ * Move the clock to the next tick or timer match, whichever comes first,
+ * and take it.
+ */
+static void Advance()
+{
+    if (timer_at < next_tick_at) {
+        if (now < timer_at) {
+            now = timer_at;
+        }
+        TimerMatch();
+    } else {
+        if (now < next_tick_at) {
+            now = next_tick_at;
+        }
+        Tick();
+    }
+}
+
+void simSetTickLimit(uint64_t ticks)
+{
+    tick_limit = ticks;
+}
+
+void simEvery(uint64_t first, uint64_t period, SimEvent fn, void *arg)
+{
+    if (event_count == SIM_EVENT_SIZE || period == 0) {
+        fprintf(stderr, "sim: too many events\n");
+        exit(1);
+    }
+    events[event_count].fn = fn;
+    events[event_count].arg = arg;
+    events[event_count].next = first;
+    events[event_count].period = period;
+    event_count++;
+}
+
+void simBusy(uint64_t cycles)
+{
+    while (cycles != 0) {
+        uint64_t next = timer_at < next_tick_at ? timer_at : next_tick_at;
+        uint64_t to_next = next > now ? next - now : 0;
+        if (cycles < to_next) {
+            now += cycles;
+            return;
+        }
+        now += to_next;
+        cycles -= to_next;
+        Advance();
+    }
+}
+
+uint64_t simNow()
+{
+    return now;
+}
+
+const SimStats *simStats()
+{
+    return &stats;
+}
+
+void simTraceReady(unsigned task_id)
+{
+    stats.wakeups++;
+    if (ready_at[task_id] == 0) {
+        ready_at[task_id] = now + 1;
+    }
+}
+
+void simTraceRun(unsigned task_id)
+{
+    if (ready_at[task_id] == 0) return;
+    uint64_t latency = now + 1 - ready_at[task_id];
+    ready_at[task_id] = 0;
+
+    uint8_t bucket = latency == 0 ? 0 : 64 - __builtin_clzll(latency);
+    if (bucket >= SIM_LATENCY_BUCKETS) {
+        bucket = SIM_LATENCY_BUCKETS - 1;
+    }
+    stats.latency[bucket]++;
+    stats.latency_count++;
+    stats.latency_sum += latency;
+    if (latency > stats.latency_max) {
+        stats.latency_max = latency;
+    }
+}
+
+void __set_PRIMASK(uint32_t mask)
+{
+    primask = mask;
+    if (!mask) {
+        TakeInterrupts();
+    }
+}
+
+/*
+ * Stop on an overflow rather than spin, a host stack is no help here.
+ */
+void moyStackOverflowHook(moy_task handler)
+{
+    fprintf(stderr, "sim: stack overflow of task %u\n", (unsigned)handler);
+    abort();
+}
+
+/*
+ * Idle: nothing to run until the next tick or timer match.
+ */
+void _moyIdleTask()
+{
+    for (;;) {
+        Advance();
+    }
+}
+
+/*
+ * Start the first frame, and come back once the tick limit is reached.
+ * Called in the syscall, so handler mode is left for the tasks meanwhile.
+ */
+void _moyLoadContext(MoyTCB* task)
+{
+    running_frame = task->stack_top;
+    running = FrameContext(running_frame);
+    if (_setjmp(main_resume) == 0) {
+        in_handler--;
+        running->started = 1;
+        setcontext(&running->start);
+    }
+    running = 0;
+    in_handler = 1;
+    primask = 0;
+    pendsv = 0;
+}
+
+moy_size _moySyscall(moy_size arg1, moy_size arg2, moy_size arg3, moy_size arg4)
+{
+    /* The preempting job is done with its coroutine. */
+    if (arg1 == SYSCALL_JOB_RESUME) {
+        dying = running;
+    }
+    in_handler++;
+    moy_size result = _moySvcHandler(arg1, arg2, arg3, arg4);
+    in_handler--;
+    TakeInterrupts();
+    return result;
+}
+
+void _moyInitTicker()
+{
+    next_tick_at = now + SIM_TICK_CYCLES;
+}
+
+void _moyYield()
+{
+    pendsv = 1;
+    TakeInterrupts();
+}
+
+void _moyInit()
+{
+}
+
+void _moyInitFrame(MoyTCB *task, TaskFunction entry, void *arg)
+{
+    SimFrame *frame = (SimFrame *)(task->stack_bottom - sizeof(SimFrame));
+    memset(frame, 0, sizeof(SimFrame));
+    frame->auto_frame.r0 = (moy_size)arg;
+    frame->auto_frame.pc = (moy_size)entry;
+    frame->auto_frame.lr = (moy_size)moyDelTask;
+    task->stack_top = (moy_size)frame;
+}
+
+void _moyInjectCall(MoyTCB *task, TaskFunction entry, void *arg)
+{
+    SimFrame *frame = (SimFrame *)(task->stack_top - sizeof(SimFrame));
+    memset(frame, 0, sizeof(SimFrame));
+    frame->auto_frame.r0 = (moy_size)arg;
+    frame->auto_frame.pc = (moy_size)entry;
+    task->stack_top = (moy_size)frame;
+}
+
+uint32_t _moyAtomicExchange(volatile uint32_t *word, uint32_t value)
+{
+    return __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+}
+
+moy_size _moyTimerNow()
+{
+    return now / (_moyCycleFrequency() / 1000000);
+}
+
+/*
+ * Match at the first cycle of the microsecond, at once if it has passed.
+ */
+void _moyTimerSet(moy_size at)
+{
+    uint64_t cycles_per_us = _moyCycleFrequency() / 1000000;
+    uint64_t us = now / cycles_per_us;
+    int64_t ahead = (int32_t)(at - (moy_size)us);
+    timer_at = ahead > 0 ? (us + ahead) * cycles_per_us : now;
+}
+
+uint8_t _moyInHandler()
+{
+    return in_handler != 0;
+}
+
+uint8_t _moyIrqInUse(uint8_t irq)
+{
+    return 0;
+}
+
+void _moyBindIrq(uint8_t irq, uint8_t priority)
+{
+}
+
+void _moyPendIrq(uint8_t irq)
+{
+    irq_pending |= 1u << irq;
+    TakeInterrupts();
+}
@@ -0,0 +1,81 @@
+/*
+ * sim_port.h @ MoyOS # Host Simulator
+ *
+ * Port of the kernel to a host process with a virtual clock.
+ * Tasks run as host coroutines, interrupts are emulated, and time only
+ * moves when a task says it is busy or the CPU is idle.
+ *
+ */
+#ifndef MOYOS_SIM_PORT_H
+#define MOYOS_SIM_PORT_H
+
+#include <stdint.h>
+
+/* size_t should be defined as "moy_size", wide enough for pointers here */
+typedef uintptr_t moy_size;
+
+/* Number of emulated interrupt lines. */
+#define MOY_IRQ_LINE_SIZE 32
+
+/* Number of IRQ task priorities. */
+#define MOY_IRQ_PRIORITY_SIZE 12
+
+/* No DMA, copies are done by the CPU. */
+#define MOY_DMA_FIRST_CHANNEL 0
+#define MOY_DMA_CHANNEL_SIZE 0
+
+/* Count leading zeros of a non-zero word. */
+#define _moyClz(x) ((uint8_t)__builtin_clz(x))
+
+/* Order memory accesses on both sides. */
+#define _moyMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Cycle counter, the virtual clock of a 72 MHz CPU. */
+#define _moyCycleCount() ((uint32_t)simNow())
+#define _moyCycleFrequency() 72000000u
+
+/* Trace hooks feeding the latency statistics. */
+#define MOY_TRACE_READY(task_id) simTraceReady(task_id)
+#define MOY_TRACE_RUN(task_id) simTraceRun(task_id)
+
+/*
+ * Initializer of a static stack, with the same layout as the target.
+ * The word of r4 holds the host context, created on the first switch.
+ */
+#define MOY_STACK_INIT(stack_size, entry, parameters) { \
+    [0 ... (stack_size) - 17] = MOY_STACK_PAINT, \
+    [(stack_size) - 16] = 0, \
+    [(stack_size) - 8] = (moy_size)(parameters), \
+    [(stack_size) - 3] = (moy_size)moyDelTask, \
+    [(stack_size) - 2] = (moy_size)(entry), \
+    [(stack_size) - 1] = 0 \
+}
+
+/* Saved at the stack top in place of registers. */
+typedef struct {
+    moy_size context;               /* host context running from this frame */
+    moy_size unused[7];
+} MoyFrame;
+
+typedef struct {
+    moy_size r0;
+    moy_size r1;
+    moy_size r2;
+    moy_size r3;
+    moy_size r12;
+    moy_size lr;
+    moy_size pc;
+    moy_size psr;
+} AutoFrame;
+
+/* Interrupt mask, as CMSIS provides it on the target. */
+void __set_PRIMASK(uint32_t primask);
+
+/* Virtual cycles since the start. */
+uint64_t simNow();
+
+void simTraceReady(unsigned task_id);
+
+void simTraceRun(unsigned task_id);
+
+#endif //MOYOS_SIM_PORT_H
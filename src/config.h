@@ -7,18 +7,87 @@
 #ifndef MOYOS_CONFIG_H
 #define MOYOS_CONFIG_H
 
-/* Size of Memory Pool for Stack and Malloc */
+/* Stack Sizes Measured by tools/stack_sizer.py, defined by make once written */
+#ifdef MOY_STACK_SIZES
+#include "stack_sizes.h"
+#endif
+
+/* Size of Memory Pool for Stack and Malloc (words) */
 #define MOY_POOL_SIZE 2500
 
 /* Maximum Task Number */
 #define MOY_TASK_SIZE 10
 
+/* Number of Task Priorities (no more than 32) */
+#define MOY_PRIORITY_SIZE 8
+
+/* Default Time Slice of a Task (ticks) */
+#define MOY_TIME_SLICE 1
+
+/*
+ * Priority Level Scheduled by Earliest Deadline First
+ * Levels above it preempt EDF tasks, levels below run when none is ready.
+ */
+#define MOY_EDF_PRIORITY 4
+
 /* Maximum Queue Number */
 #define MOY_QUEUE_SIZE 10
 
+/* Maximum Message Pool Number */
+#define MOY_MSG_POOL_SIZE 4
+
+/* Maximum Stream Buffer Number */
+#define MOY_STREAM_SIZE 4
+
+/* Maximum Topic Number, and Subscribers of Each */
+#define MOY_TOPIC_SIZE 4
+#define MOY_TOPIC_SUBSCRIBER_SIZE 8
+
+/* Maximum Latest-value Mailbox Number */
+#define MOY_MAILBOX_SIZE 4
+
+/* Maximum Triple Buffer Number */
+#define MOY_TRIPLE_SIZE 2
+
+/* Maximum Call Endpoint Number */
+#define MOY_ENDPOINT_SIZE 4
+
+/* Maximum Mutex, Condition Variable and Reader-writer Lock Numbers */
+#define MOY_MUTEX_SIZE 8
+#define MOY_COND_SIZE 8
+#define MOY_RWLOCK_SIZE 4
+
+/* Maximum Run-to-completion Job Number */
+#define MOY_JOB_SIZE 32
+
+/* Number of Job Preemption Levels (no more than 31) */
+#define MOY_JOB_LEVEL_SIZE 8
+
+/* Size of the Stack Shared by All Jobs, unless measured */
+#ifdef MOY_STACK_JOBS
+#define MOY_JOB_STACK_SIZE MOY_STACK_JOBS
+#else
+#define MOY_JOB_STACK_SIZE 256
+#endif
+
+/* Priority of the Task Running Jobs */
+#define MOY_JOB_PRIORITY (MOY_PRIORITY_SIZE - 1)
+
+/* Maximum IRQ Task Number */
+#define MOY_IRQ_TASK_SIZE 8
+
+/* Smallest Copy Worth Handing to DMA (bytes) */
+#define MOY_COPY_THRESHOLD 256
+
 /* Maximum Length of Task Name */
 #define MOY_TASK_NAME_SIZE 10
 
+/* Check for Stack Overflow on Every Switch (0 or 1) */
+#define MOY_STACK_CHECK 1
+
+/* Wake moyDelayUs Sleepers with a Hardware Timer, else round up to Ticks (0 or 1) */
+#define MOY_PRECISE_TIMER 1
+
 /* Interval between Switching Tasks (ms) */
 #define MOY_SWITCH_INTERVAL 1
 
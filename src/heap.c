@@ -0,0 +1,291 @@
+/*
+ * heap.c @ MoyOS
+ *
+ * Two-level segregated fit allocator over the memory pool.
+ * Both moyMalloc and moyFree run in constant time: a fixed number of
+ * bitmap lookups and list operations, with no loop over blocks.
+ *
+ */
+#include "moyos.h"
+
+/* Blocks are 8-byte aligned, which stacks also need. */
+#define ALIGN_LOG2 3
+#define ALIGN_SIZE (1u << ALIGN_LOG2)
+
+/* Each power of two is split into 16 second-level lists. */
+#define SL_INDEX_LOG2 4
+#define SL_INDEX_COUNT (1u << SL_INDEX_LOG2)
+
+/* Blocks below this size are kept in linear lists of the first row. */
+#define FL_INDEX_SHIFT (SL_INDEX_LOG2 + ALIGN_LOG2)
+#define SMALL_BLOCK_SIZE (1u << FL_INDEX_SHIFT)
+
+/* Enough first-level rows to cover the pool, fewer for small pools. */
+#if MOY_POOL_SIZE < (1 << 12)
+#define FL_INDEX_MAX 15
+#else
+#define FL_INDEX_MAX 24
+#endif
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+
+#define BLOCK_FREE 1u
+#define BLOCK_SIZE_MASK (~(ALIGN_SIZE - 1))
+
+typedef struct MoyBlock {
+    struct MoyBlock *prev_phys;     /* block just below, 0 for the first */
+    moy_size size;                  /* payload size, low bit set if free */
+    struct MoyBlock *next_free;     /* free list links, in the payload */
+    struct MoyBlock *prev_free;
+} MoyBlock;
+
+/* The fields in front of the payload, all the end sentinel has room for. */
+typedef struct {
+    MoyBlock *prev_phys;
+    moy_size size;
+} MoyBlockHeader;
+
+/* Bytes in front of the payload. */
+#define BLOCK_HEADER_SIZE __builtin_offsetof(MoyBlock, next_free)
+
+_Static_assert(sizeof(MoyBlockHeader) == BLOCK_HEADER_SIZE, "MoyBlockHeader should match MoyBlock");
+
+/* A split is only worth it if the rest can hold the free list links. */
+#define BLOCK_MIN_SIZE (sizeof(MoyBlock) - BLOCK_HEADER_SIZE)
+
+/* Memory pool to be allocated from. */
+static moy_size pool[MOY_POOL_SIZE] __attribute__((aligned(8)));
+
+_Static_assert(sizeof(pool) < (1u << FL_INDEX_MAX), "MOY_POOL_SIZE is too large for the heap");
+
+/* Free lists and the bitmaps telling which are non-empty. */
+static MoyBlock *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+static uint32_t fl_bitmap = 0;
+static uint32_t sl_bitmap[FL_INDEX_COUNT];
+static uint8_t heap_ready = 0;
+
+/* Bytes currently handed out, for moyHeapUsed. */
+static moy_size used_size = 0;
+
+static inline uint8_t Fls(uint32_t word)
+{
+    return 31 - _moyClz(word);
+}
+
+static inline uint8_t Ffs(uint32_t word)
+{
+    return 31 - _moyClz(word & -word);
+}
+
+static inline moy_size BlockSize(MoyBlock *block)
+{
+    return block->size & BLOCK_SIZE_MASK;
+}
+
+static inline uint8_t BlockIsFree(MoyBlock *block)
+{
+    return block->size & BLOCK_FREE;
+}
+
+static inline void *BlockToPtr(MoyBlock *block)
+{
+    return (uint8_t *)block + BLOCK_HEADER_SIZE;
+}
+
+static inline MoyBlock *PtrToBlock(void *ptr)
+{
+    return (MoyBlock *)((uint8_t *)ptr - BLOCK_HEADER_SIZE);
+}
+
+static inline MoyBlock *NextPhys(MoyBlock *block)
+{
+    return (MoyBlock *)((uint8_t *)BlockToPtr(block) + BlockSize(block));
+}
+
+/*
+ * Find the list a block of some size belongs to.
+ */
+static inline void MappingInsert(moy_size size, uint8_t *fl, uint8_t *sl)
+{
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = size >> ALIGN_LOG2;
+    } else {
+        uint8_t bit = Fls(size);
+        *sl = (size >> (bit - SL_INDEX_LOG2)) ^ SL_INDEX_COUNT;
+        *fl = bit - FL_INDEX_SHIFT + 1;
+    }
+}
+
+/*
+ * Find the first list whose blocks all fit a request.
+ */
+static inline void MappingSearch(moy_size size, uint8_t *fl, uint8_t *sl)
+{
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += (1u << (Fls(size) - SL_INDEX_LOG2)) - 1;
+    }
+    MappingInsert(size, fl, sl);
+}
+
+static void InsertFree(MoyBlock *block)
+{
+    uint8_t fl, sl;
+    MappingInsert(BlockSize(block), &fl, &sl);
+
+    MoyBlock *head = blocks[fl][sl];
+    block->next_free = head;
+    block->prev_free = 0;
+    if (head != 0) {
+        head->prev_free = block;
+    }
+    blocks[fl][sl] = block;
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+static void RemoveFree(MoyBlock *block)
+{
+    uint8_t fl, sl;
+    MappingInsert(BlockSize(block), &fl, &sl);
+
+    if (block->next_free != 0) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (block->prev_free != 0) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        blocks[fl][sl] = block->next_free;
+        if (block->next_free == 0) {
+            sl_bitmap[fl] &= ~(1u << sl);
+            if (sl_bitmap[fl] == 0) {
+                fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+}
+
+/*
+ * Find a free block of at least some size, or 0.
+ */
+static MoyBlock *FindFree(moy_size size)
+{
+    uint8_t fl, sl;
+    MappingSearch(size, &fl, &sl);
+    if (fl >= FL_INDEX_COUNT) {
+        return 0;
+    }
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        /* Nothing in this row, take the next non-empty one. */
+        uint32_t fl_map = fl_bitmap & (~0u << (fl + 1));
+        if (fl_map == 0) {
+            return 0;
+        }
+        fl = Ffs(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return blocks[fl][Ffs(sl_map)];
+}
+
+/*
+ * Make the whole pool one free block, closed by a used empty sentinel.
+ */
+static void HeapInit()
+{
+    MoyBlock *block = (MoyBlock *)pool;
+    block->prev_phys = 0;
+    block->size = sizeof(pool) - 2 * BLOCK_HEADER_SIZE;
+
+    MoyBlockHeader *sentinel = (MoyBlockHeader *)NextPhys(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+
+    block->size |= BLOCK_FREE;
+    InsertFree(block);
+    heap_ready = 1;
+}
+
+/*
+ * Allocate memory from the pool.
+ * Return 0 if no free block is large enough.
+ */
+void *moyMalloc(moy_size size)
+{
+    if (size == 0 || size > sizeof(pool)) {
+        return 0;
+    }
+    size = (size + ALIGN_SIZE - 1) & BLOCK_SIZE_MASK;
+    if (size < BLOCK_MIN_SIZE) {
+        size = BLOCK_MIN_SIZE;
+    }
+
+    moyEnterCritical();
+    if (!heap_ready) {
+        HeapInit();
+    }
+    MoyBlock *block = FindFree(size);
+    if (block == 0) {
+        moyLeaveCritical();
+        return 0;
+    }
+    RemoveFree(block);
+
+    /* Give the tail back if it can stand as a block of its own. */
+    moy_size remain = BlockSize(block) - size;
+    if (remain >= sizeof(MoyBlock)) {
+        block->size = size;
+        MoyBlock *rest = NextPhys(block);
+        rest->prev_phys = block;
+        rest->size = (remain - BLOCK_HEADER_SIZE) | BLOCK_FREE;
+        NextPhys(rest)->prev_phys = rest;
+        InsertFree(rest);
+    } else {
+        block->size &= ~BLOCK_FREE;
+    }
+    used_size += BlockSize(block);
+    moyLeaveCritical();
+    return BlockToPtr(block);
+}
+
+/*
+ * Give memory back to the pool, merging it with free neighbours.
+ */
+void moyFree(void *ptr)
+{
+    if ((moy_size *)ptr <= pool || (moy_size *)ptr >= pool + MOY_POOL_SIZE) {
+        return;
+    }
+    moyEnterCritical();
+    MoyBlock *block = PtrToBlock(ptr);
+    if (BlockIsFree(block)) {
+        moyLeaveCritical();
+        return;
+    }
+    used_size -= BlockSize(block);
+
+    MoyBlock *prev = block->prev_phys;
+    if (prev != 0 && BlockIsFree(prev)) {
+        RemoveFree(prev);
+        prev->size += BlockSize(block) + BLOCK_HEADER_SIZE;
+        block = prev;
+    }
+    MoyBlock *next = NextPhys(block);
+    if (BlockIsFree(next)) {
+        RemoveFree(next);
+        block->size += BlockSize(next) + BLOCK_HEADER_SIZE;
+        next = NextPhys(block);
+    }
+    next->prev_phys = block;
+    block->size |= BLOCK_FREE;
+    InsertFree(block);
+    moyLeaveCritical();
+}
+
+/*
+ * Bytes currently allocated, headers excluded.
+ */
+moy_size moyHeapUsed()
+{
+    return used_size;
+}
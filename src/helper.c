@@ -3,30 +3,152 @@
  *
  * Helper functions to get rid of C libraries.
  *
+ * Copies and fills move 32-bit words once the destination is aligned,
+ * and blocks of 32 bytes with one LDM/STM pair of 8 registers.
+ * Cortex-M3 allows unaligned LDR, so a source off by a few bytes still
+ * goes word by word.
+ *
  */
 #include "helper.h"
 
-void* memcpy(void *destination, const void *source, uint32_t num)
+/* Word that may sit at any address, for unaligned LDR. */
+typedef uint32_t __attribute__((aligned(1), may_alias)) UnalignedWord;
+
+/* Word sharing storage with bytes. */
+typedef uint32_t __attribute__((may_alias)) AliasWord;
+
+/* Below this, setting up word moves costs more than it saves. */
+#define WORD_THRESHOLD 8
+
+/*
+ * Copy 32-byte blocks between word-aligned buffers.
+ * Return the number of bytes copied.
+ */
+static inline moy_size CopyBlocks(AliasWord **dst, const AliasWord **src, moy_size num)
+{
+    moy_size blocks = num >> 5;
+#ifdef __thumb2__
+    moy_size count = blocks;
+    /* r7 is left out, it may be the frame pointer. */
+    while (count--) {
+        __asm__ __volatile__ (
+            R"(
+            ldmia %1!, {r3-r6, r8-r11}
+            stmia %0!, {r3-r6, r8-r11}
+            )"
+            : "+r" (*dst), "+r" (*src)
+            :
+            : "r3", "r4", "r5", "r6", "r8", "r9", "r10", "r11", "memory"
+        );
+    }
+#else
+    moy_size count = blocks * 8;
+    while (count--) {
+        *((*dst)++) = *((*src)++);
+    }
+#endif
+    return blocks << 5;
+}
+
+void* memcpy(void *destination, const void *source, moy_size num)
 {
-    unsigned char *dst = destination, *src = source;
+    unsigned char *dst = destination;
+    const unsigned char *src = source;
+
+    if (num >= WORD_THRESHOLD) {
+        /* Align the destination first. */
+        while ((moy_size)dst & 3) {
+            *(dst++) = *(src++);
+            num--;
+        }
+        if (((moy_size)src & 3) == 0) {
+            AliasWord *dst_word = (AliasWord *)dst;
+            const AliasWord *src_word = (const AliasWord *)src;
+            num -= CopyBlocks(&dst_word, &src_word, num);
+            while (num >= 4) {
+                *(dst_word++) = *(src_word++);
+                num -= 4;
+            }
+            dst = (unsigned char *)dst_word;
+            src = (const unsigned char *)src_word;
+        } else {
+            while (num >= 4) {
+                *(AliasWord *)dst = *(const UnalignedWord *)src;
+                dst += 4;
+                src += 4;
+                num -= 4;
+            }
+        }
+    }
     while (num--) {
         *(dst++) = *(src++);
     }
     return destination;
 }
 
-void* memset(void *destination, int value, uint32_t n)
+void* memset(void *destination, int value, moy_size n)
 {
     const unsigned char v = (unsigned char)value;
-    unsigned char *dst;
-    for(dst = destination; n > 0; ++dst, --n)
+    unsigned char *dst = destination;
+
+    if (n >= WORD_THRESHOLD) {
+        while ((moy_size)dst & 3) {
+            *(dst++) = v;
+            n--;
+        }
+        uint32_t word = v * 0x01010101u;
+        AliasWord *dst_word = (AliasWord *)dst;
+#ifdef __thumb2__
+        moy_size blocks = n >> 5;
+        if (blocks) {
+            register uint32_t r3 asm("r3") = word;
+            register uint32_t r4 asm("r4") = word;
+            register uint32_t r5 asm("r5") = word;
+            register uint32_t r6 asm("r6") = word;
+            register uint32_t r8 asm("r8") = word;
+            register uint32_t r9 asm("r9") = word;
+            register uint32_t r10 asm("r10") = word;
+            register uint32_t r11 asm("r11") = word;
+            while (blocks--) {
+                __asm__ __volatile__ (
+                    "stmia %0!, {r3-r6, r8-r11}"
+                    : "+r" (dst_word)
+                    : "r" (r3), "r" (r4), "r" (r5), "r" (r6),
+                      "r" (r8), "r" (r9), "r" (r10), "r" (r11)
+                    : "memory"
+                );
+            }
+            n &= 31;
+        }
+#endif
+        while (n >= 4) {
+            *(dst_word++) = word;
+            n -= 4;
+        }
+        dst = (unsigned char *)dst_word;
+    }
+    for(; n > 0; ++dst, --n)
         *dst = v;
     return destination;
 }
 
+/* Non-zero if any byte of the word is zero. */
+#define HAS_ZERO_BYTE(w) (((w) - 0x01010101u) & ~(w) & 0x80808080u)
+
 char* strcpy(char *destination, const char *source)
 {
     char *rt = destination;
+
+    /* Word by word while both sides are aligned and no terminator is seen. */
+    if ((((moy_size)destination | (moy_size)source) & 3) == 0) {
+        AliasWord *dst_word = (AliasWord *)destination;
+        const AliasWord *src_word = (const AliasWord *)source;
+        while (!HAS_ZERO_BYTE(*src_word)) {
+            *(dst_word++) = *(src_word++);
+        }
+        destination = (char *)dst_word;
+        source = (const char *)src_word;
+    }
     while (*source != '\0') {
         *(destination++) = *(source++);
     }
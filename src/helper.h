@@ -7,10 +7,14 @@
 #ifndef MOYOS_HELPER_H
 #define MOYOS_HELPER_H
 
+#ifdef MOY_PORT_HEADER
+#include MOY_PORT_HEADER
+#else
 #include "port.h"
+#endif
 
-void* memcpy(void *destination, const void *source, uint32_t num);
-void* memset(void *destination, int value, uint32_t n);
+void* memcpy(void *destination, const void *source, moy_size num);
+void* memset(void *destination, int value, moy_size n);
 char* strcpy(char *destination, const char *source);
 
 #endif //MOYOS_HELPER_H
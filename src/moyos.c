@@ -7,312 +7,3190 @@
 #include "moyos.h"
 #include "helper.h"
 
-/* Task control blocks. */
-MoyTCB tasks[MOY_TASK_SIZE];
-uint8_t task_count = 0;
-uint8_t current_task = (uint8_t)-1;
-uint8_t idle_task_id;
+/* Static tasks: entries, stacks with their first frame, and TCBs. */
+#define STATIC_ENTRY(id, entry, parameters, words, prio) \
+    void entry();
+#define STATIC_STACK(id, entry, parameters, words, prio) \
+    moy_size id##_stack[words] __attribute__((aligned(8))) = \
+        MOY_STACK_INIT(words, entry, parameters);
+#define STATIC_CHECK(id, entry, parameters, words, prio) \
+    _Static_assert((prio) > 0 && (prio) < MOY_PRIORITY_SIZE \
+                   && (prio) != MOY_EDF_PRIORITY, "bad priority of " #id); \
+    _Static_assert((words) >= 32, "stack of " #id " is too small");
+#define STATIC_TCB(id, entry, parameters, words, prio) { \
+    .name = #id, \
+    .status = TASK_READY, \
+    .priority = prio, \
+    .base_priority = prio, \
+    .time_slice = MOY_TIME_SLICE, \
+    .slice_left = MOY_TIME_SLICE, \
+    .stack_size = words, \
+    .stack_top = (moy_size)(id##_stack + (words) - 16), \
+    .stack_bottom = (moy_size)(id##_stack + (words)) \
+},
+
+STATIC_ENTRY(idle, _moyIdleTask, 0, 32, 0)
+MOY_STATIC_TASKS(STATIC_ENTRY)
+STATIC_STACK(idle, _moyIdleTask, 0, 32, 0)
+MOY_STATIC_TASKS(STATIC_STACK)
+MOY_STATIC_TASKS(STATIC_CHECK)
+
+_Static_assert(MOY_STATIC_TASK_COUNT + MOY_TASK_SIZE < NO_TASK, "too many tasks");
+
+/* Task control blocks, static tasks first. */
+MoyTCB tasks[MOY_STATIC_TASK_COUNT + MOY_TASK_SIZE] = {
+    STATIC_TCB(idle, _moyIdleTask, 0, 32, 0)
+    MOY_STATIC_TASKS(STATIC_TCB)
+};
+moy_task task_count = MOY_STATIC_TASK_COUNT;
+moy_task current_task = NO_TASK;
+moy_task direct_task = NO_TASK;
+moy_task idle_task_id = MOY_TASK_IDLE;
+uint8_t static_linked = 0;
+
+/* Ready lists, one FIFO per priority, and a bitmap of non-empty ones. */
+moy_task ready_head[MOY_PRIORITY_SIZE];
+moy_task ready_tail[MOY_PRIORITY_SIZE];
+uint32_t ready_bitmap = 0;
+
+/* Ticks since the OS started. */
+moy_size tick_count = 0;
+
+/* Tasks in moyDelayUs, soonest first, linked through next and prev. */
+moy_task precise_head = NO_TASK;
+
+/* Wraps of the cycle counter, and its value when last read. */
+uint32_t cycle_high = 0;
+uint32_t cycle_last = 0;
 
 /* Queues. */
-MoyQueue queues[MOY_QUEUE_SIZE];
-uint8_t queue_count = 0;
+MoyQueue queues[MOY_STATIC_QUEUE_COUNT + MOY_QUEUE_SIZE];
+uint8_t queue_count = MOY_STATIC_QUEUE_COUNT;
+
+/* Tasks dispatched by the NVIC, and the task bound to each line (handle + 1). */
+MoyIrqTask irq_tasks[MOY_IRQ_TASK_SIZE];
+uint8_t irq_task_count = 0;
+uint8_t irq_task_map[MOY_IRQ_LINE_SIZE];
+
+/* Run-to-completion jobs, all run by one host task on its stack. */
+MoyJob jobs[MOY_JOB_SIZE];
+uint8_t job_count = 0;
+moy_task job_host_id = NO_TASK;
+uint8_t job_head[MOY_JOB_LEVEL_SIZE + 1];
+uint8_t job_tail[MOY_JOB_LEVEL_SIZE + 1];
+uint32_t job_bitmap = 0;
+uint8_t srp_ceiling = 0;
+uint8_t job_injected = 0;
+moy_size job_resume_top = 0;
+
+/* Topics, fanning messages out to subscriber queues. */
+MoyTopic topics[MOY_TOPIC_SIZE];
+uint8_t topic_count = 0;
+
+/* Mailboxes holding the latest value written. */
+MoyMailbox mailboxes[MOY_MAILBOX_SIZE];
+uint8_t mailbox_count = 0;
+
+/* Triple buffers, the middle one passed by atomic exchange. */
+MoyTriple triples[MOY_TRIPLE_SIZE];
+uint8_t triple_count = 0;
+
+/* Locks. */
+MoyMutex mutexes[MOY_MUTEX_SIZE];
+uint8_t mutex_count = 0;
+MoyCond conds[MOY_COND_SIZE];
+uint8_t cond_count = 0;
+MoyRwLock rwlocks[MOY_RWLOCK_SIZE];
+uint8_t rwlock_count = 0;
+
+/* Endpoints of synchronous calls. */
+MoyEndpoint endpoints[MOY_ENDPOINT_SIZE];
+uint8_t endpoint_count = 0;
+
+/* Byte streams. */
+MoyStream streams[MOY_STREAM_SIZE];
+uint8_t stream_count = 0;
+
+/* Pools of fixed-size message buffers. */
+MoyMsgPool msg_pools[MOY_MSG_POOL_SIZE];
+uint8_t msg_pool_count = 0;
+
+#if MOY_DMA_CHANNEL_SIZE
+/* Copies in flight, one per DMA channel. */
+MoyCopy copies[MOY_DMA_CHANNEL_SIZE];
+#endif
 
 /* Status. */
 uint8_t started = 0;
 uint8_t critical_depth = 0;
 
-/* Memory pool to be allocated from. */
-moy_size *pool[MOY_POOL_SIZE];
-moy_size pool_count = 0;
+/*
+ * Get the deadline ordering a task in the EDF level: that of its job, or
+ * an earlier one inherited from a task waiting for a lock it holds.
+ */
+static inline moy_size EdfDeadline(MoyTCB *this_task)
+{
+    return this_task->deadline_lent ? this_task->lent_deadline : this_task->abs_deadline;
+}
+
+/*
+ * Insert a task into the EDF level, behind those due no later than it.
+ * The scan only covers the EDF level.
+ */
+static void EdfInsert(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    moy_task after = NO_TASK;
+    moy_task before = ready_head[MOY_EDF_PRIORITY];
+
+    if (!(ready_bitmap & (1u << MOY_EDF_PRIORITY))) {
+        before = NO_TASK;
+    }
+    while (before != NO_TASK
+            && (int32_t)(EdfDeadline(tasks + before) - EdfDeadline(this_task)) <= 0) {
+        after = before;
+        before = tasks[before].next;
+    }
+
+    this_task->prev = after;
+    this_task->next = before;
+    if (after == NO_TASK) {
+        ready_head[MOY_EDF_PRIORITY] = task_id;
+    } else {
+        tasks[after].next = task_id;
+    }
+    if (before == NO_TASK) {
+        ready_tail[MOY_EDF_PRIORITY] = task_id;
+    } else {
+        tasks[before].prev = task_id;
+    }
+    ready_bitmap |= 1u << MOY_EDF_PRIORITY;
+}
+
+/*
+ * Append a task to the tail of the ready list of its priority.
+ * The EDF level is kept ordered by absolute deadline instead.
+ */
+static void ReadyPush(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    uint8_t priority = this_task->priority;
+
+    if (priority == MOY_EDF_PRIORITY) {
+        EdfInsert(task_id);
+        return;
+    }
+    this_task->next = NO_TASK;
+    if (ready_bitmap & (1u << priority)) {
+        this_task->prev = ready_tail[priority];
+        tasks[ready_tail[priority]].next = task_id;
+    } else {
+        this_task->prev = NO_TASK;
+        ready_head[priority] = task_id;
+        ready_bitmap |= 1u << priority;
+    }
+    ready_tail[priority] = task_id;
+}
+
+/*
+ * Unlink a task from the ready list of its priority.
+ */
+static void ReadyRemove(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    uint8_t priority = this_task->priority;
+
+    if (this_task->prev == NO_TASK) {
+        ready_head[priority] = this_task->next;
+    } else {
+        tasks[this_task->prev].next = this_task->next;
+    }
+    if (this_task->next == NO_TASK) {
+        ready_tail[priority] = this_task->prev;
+    } else {
+        tasks[this_task->next].prev = this_task->prev;
+    }
+    if (ready_head[priority] == NO_TASK) {
+        ready_bitmap &= ~(1u << priority);
+    }
+}
+
+/*
+ * Check if a waiter stays ahead of another: it has a higher priority, or
+ * the same one and came first, or an earlier deadline in the EDF level.
+ */
+static inline uint8_t WaitsAhead(MoyTCB *waiter, MoyTCB *other)
+{
+    if (waiter->priority != other->priority) {
+        return waiter->priority > other->priority;
+    }
+    if (waiter->priority == MOY_EDF_PRIORITY) {
+        return (int32_t)(EdfDeadline(waiter) - EdfDeadline(other)) <= 0;
+    }
+    return 1;
+}
+
+/*
+ * Insert a task into a wait list, behind the waiters more urgent or as
+ * urgent, so the first is the most urgent and peers wake in turn.
+ */
+static void WaitInsert(moy_task task_id, MoyWaitList *list)
+{
+    MoyTCB *this_task = tasks + task_id;
+    moy_task after = NO_TASK;
+    moy_task before = (moy_task)(list->first - 1);
+
+    while (before != NO_TASK && WaitsAhead(tasks + before, this_task)) {
+        after = before;
+        before = tasks[before].next;
+    }
+    this_task->prev = after;
+    this_task->next = before;
+    if (after == NO_TASK) {
+        list->first = task_id + 1;
+    } else {
+        tasks[after].next = task_id;
+    }
+    if (before != NO_TASK) {
+        tasks[before].prev = task_id;
+    }
+    this_task->wait_list = list;
+}
+
+/*
+ * Unlink a task from the wait list it is in.
+ */
+static void WaitRemove(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    if (this_task->prev == NO_TASK) {
+        this_task->wait_list->first = (moy_task)(this_task->next + 1);
+    } else {
+        tasks[this_task->prev].next = this_task->next;
+    }
+    if (this_task->next != NO_TASK) {
+        tasks[this_task->next].prev = this_task->prev;
+    }
+    this_task->wait_list = 0;
+}
+
+/*
+ * Get the first task of a wait list, or NO_TASK.
+ */
+static inline moy_task FirstWaiter(MoyWaitList *list)
+{
+    return (moy_task)(list->first - 1);
+}
+
+/*
+ * Mark a waiting task ready again.
+ */
+static void MakeReady(moy_task task_id)
+{
+    if (tasks[task_id].wait_list != 0) {
+        WaitRemove(task_id);
+    }
+    tasks[task_id].status = TASK_READY;
+    ReadyPush(task_id);
+    MOY_TRACE_READY(task_id);
+}
+
+/*
+ * Take the current task off the ready list until woken or timed out.
+ * It waits in list, unless list is 0.
+ */
+static void BlockCurrent(uint16_t status, MoyWaitList *list, moy_size timeout)
+{
+    MoyTCB *this_task = tasks + current_task;
+    ReadyRemove(current_task);
+    this_task->status = status;
+    this_task->sleep_time = timeout;
+    if (list != 0) {
+        WaitInsert(current_task, list);
+    }
+}
+
+/*
+ * Wake the most urgent task of a wait list, if there is any.
+ */
+static void WakeWaiter(MoyWaitList *list)
+{
+    moy_task task_id = FirstWaiter(list);
+    if (task_id != NO_TASK) {
+        MakeReady(task_id);
+    }
+}
+
+#if MOY_PRECISE_TIMER
+/*
+ * Insert a task into the precise sleepers, behind those due no later.
+ * Return 1 if it is now the first to wake.
+ */
+static uint8_t PreciseInsert(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    moy_task after = NO_TASK;
+    moy_task before = precise_head;
+
+    while (before != NO_TASK
+            && (int32_t)(tasks[before].wake_at - this_task->wake_at) <= 0) {
+        after = before;
+        before = tasks[before].next;
+    }
+    this_task->prev = after;
+    this_task->next = before;
+    if (after == NO_TASK) {
+        precise_head = task_id;
+    } else {
+        tasks[after].next = task_id;
+    }
+    if (before != NO_TASK) {
+        tasks[before].prev = task_id;
+    }
+    return after == NO_TASK;
+}
+
+/*
+ * Unlink a task from the precise sleepers.
+ */
+static void PreciseRemove(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    if (this_task->prev == NO_TASK) {
+        precise_head = this_task->next;
+    } else {
+        tasks[this_task->prev].next = this_task->next;
+    }
+    if (this_task->next != NO_TASK) {
+        tasks[this_task->next].prev = this_task->prev;
+    }
+}
+#endif
+
+/*
+ * Move a ready task behind its peers and refill its time slice.
+ */
+static void Rotate(moy_task task_id)
+{
+    tasks[task_id].slice_left = tasks[task_id].time_slice;
+    ReadyRemove(task_id);
+    ReadyPush(task_id);
+}
+
+/*
+ * Raise a priority to that of a task waiting for a lock, if higher.
+ * A waiter in the EDF level lends the level, and its deadline if it is
+ * earlier than the one in deadline; lent is set when it does.
+ */
+static uint8_t Inherit(uint8_t priority, moy_task from, uint8_t *lent, moy_size *deadline)
+{
+    if (from == NO_TASK) {
+        return priority;
+    }
+    MoyTCB *waiter = tasks + from;
+    if (waiter->priority != MOY_EDF_PRIORITY || priority > MOY_EDF_PRIORITY) {
+        return waiter->priority > priority ? waiter->priority : priority;
+    }
+    moy_size waiter_deadline = EdfDeadline(waiter);
+    if (priority < MOY_EDF_PRIORITY || (int32_t)(waiter_deadline - *deadline) < 0) {
+        *deadline = waiter_deadline;
+        *lent = 1;
+    }
+    return MOY_EDF_PRIORITY;
+}
+
+/*
+ * Get the priority a task should run at: its own, one lent by a caller,
+ * or that of the most urgent task waiting for a lock it holds, to read
+ * or to write. Also get the deadline ordering it in the EDF level, which
+ * starts as that of its job.
+ */
+static uint8_t EffectivePriority(moy_task task_id, uint8_t *lent, moy_size *deadline)
+{
+    MoyTCB *this_task = tasks + task_id;
+    uint8_t priority = this_task->base_priority;
+
+    /* A caller in the EDF level lends no deadline, so not the level. */
+    if (this_task->lent_priority > priority && this_task->lent_priority != MOY_EDF_PRIORITY) {
+        priority = this_task->lent_priority;
+    }
+
+    uint8_t i;
+    for (i = 0; i < mutex_count; ++i) {
+        if (mutexes[i].owner == task_id) {
+            priority = Inherit(priority, FirstWaiter(&mutexes[i].waiters), lent, deadline);
+        }
+    }
+    for (i = 0; i < rwlock_count; ++i) {
+        MoyRwLock *this_lock = rwlocks + i;
+        if (this_lock->writer == task_id) {
+            priority = Inherit(priority, FirstWaiter(&this_lock->writers_waiting), lent, deadline);
+            priority = Inherit(priority, FirstWaiter(&this_lock->readers_waiting), lent, deadline);
+        } else if (this_task->read_held & (1u << i)) {
+            /* Only writers wait for readers. */
+            priority = Inherit(priority, FirstWaiter(&this_lock->writers_waiting), lent, deadline);
+        }
+    }
+    return priority;
+}
+
+/*
+ * Bring a task to the priority and deadline it should run at.
+ * Return 1 if they changed.
+ */
+static uint8_t Refresh(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    uint8_t lent = 0;
+    moy_size deadline = this_task->abs_deadline;
+    uint8_t priority = EffectivePriority(task_id, &lent, &deadline);
+    if (priority != MOY_EDF_PRIORITY) {
+        /* Raised past the EDF level, where deadlines do not count. */
+        lent = 0;
+    }
+    if (priority == this_task->priority && lent == this_task->deadline_lent
+            && (!lent || deadline == this_task->lent_deadline)) {
+        return 0;
+    }
+
+    /* Lists are ordered by these, so change them off the list. */
+    MoyWaitList *list = this_task->wait_list;
+    if (this_task->status == TASK_READY) {
+        ReadyRemove(task_id);
+    } else if (list != 0) {
+        WaitRemove(task_id);
+    }
+    this_task->priority = priority;
+    this_task->deadline_lent = lent;
+    this_task->lent_deadline = deadline;
+    if (this_task->status == TASK_READY) {
+        ReadyPush(task_id);
+    } else if (list != 0) {
+        WaitInsert(task_id, list);
+    }
+    return 1;
+}
+
+/*
+ * Bring the holders of the lock a task waits for, as status in list, to
+ * the priority they should run at, and on down the chain up to depth.
+ * A chain through readers of a reader-writer lock branches, one for each.
+ */
+static void UpdateHolders(uint16_t status, MoyWaitList *list, uint8_t depth)
+{
+    for (;;) {
+        moy_task holder;
+        if (status == TASK_BLOCKED_MUTEX) {
+            holder = mutexes[((uint8_t *)list - (uint8_t *)mutexes) / sizeof(MoyMutex)].owner;
+        } else if (status == TASK_BLOCKED_RWLOCK) {
+            MoyRwLock *this_lock = rwlocks + ((uint8_t *)list - (uint8_t *)rwlocks) / sizeof(MoyRwLock);
+            holder = this_lock->writer;
+            if (holder == NO_TASK) {
+                /* Readers are not listed in the lock, only in their tasks. */
+                uint32_t bit = 1u << (this_lock - rwlocks);
+                moy_size found = 0;
+                for (holder = 0; holder < task_count && found < this_lock->readers; ++holder) {
+                    if (!(tasks[holder].read_held & bit)) continue;
+                    found++;
+                    if (Refresh(holder) && depth) {
+                        UpdateHolders(tasks[holder].status, tasks[holder].wait_list, depth - 1);
+                    }
+                }
+                return;
+            }
+        } else {
+            return;
+        }
+        if (holder == NO_TASK || !Refresh(holder) || depth == 0) return;
+        depth--;
+        status = tasks[holder].status;
+        list = tasks[holder].wait_list;
+    }
+}
+
+/*
+ * Bring a task to the priority it should run at, then the holders of
+ * the lock it waits for, and so on down the chain.
+ */
+static void UpdatePriority(moy_task task_id)
+{
+    if (task_id != NO_TASK && Refresh(task_id)) {
+        UpdateHolders(tasks[task_id].status, tasks[task_id].wait_list,
+                      MOY_MUTEX_SIZE + MOY_RWLOCK_SIZE);
+    }
+}
+
+/*
+ * Hand a mutex to its most urgent waiter, or free it.
+ * Called in the critical section.
+ */
+static void MutexRelease(MoyMutex *this_mutex)
+{
+    moy_task next_owner = FirstWaiter(&this_mutex->waiters);
+    this_mutex->owner = next_owner;
+    if (next_owner != NO_TASK) {
+        MakeReady(next_owner);
+        UpdatePriority(next_owner);
+    }
+}
+
+/*
+ * Hand a reader-writer lock no writer holds to the most urgent writer
+ * waiting once readers are out, or else to every reader waiting.
+ */
+static void RwLockGrant(MoyRwLock *this_lock)
+{
+    if (this_lock->writer != NO_TASK) return;
+    moy_task waiter = FirstWaiter(&this_lock->writers_waiting);
+    if (waiter != NO_TASK) {
+        if (this_lock->readers == 0) {
+            this_lock->writer = waiter;
+            MakeReady(waiter);
+            UpdatePriority(waiter);
+        }
+        return;
+    }
+    uint32_t bit = 1u << (this_lock - rwlocks);
+    while ((waiter = FirstWaiter(&this_lock->readers_waiting)) != NO_TASK) {
+        this_lock->readers++;
+        tasks[waiter].read_held |= bit;
+        MakeReady(waiter);
+    }
+}
+
+/*
+ * Take a task out of the wait list it blocks in, and let the holders of
+ * the lock it waited for drop the priority it lent.
+ */
+static void WaitCancel(moy_task task_id)
+{
+    uint16_t status = tasks[task_id].status;
+    MoyWaitList *list = tasks[task_id].wait_list;
+    WaitRemove(task_id);
+    UpdateHolders(status, list, MOY_MUTEX_SIZE + MOY_RWLOCK_SIZE);
+
+    /* Readers held back by a writer that left may go. */
+    if (status == TASK_BLOCKED_RWLOCK) {
+        RwLockGrant(rwlocks + ((uint8_t *)list - (uint8_t *)rwlocks) / sizeof(MoyRwLock));
+    }
+}
+
+/*
+ * Let go of every lock a task holds, as if it unlocked them.
+ * Called in the critical section when it is deleted.
+ */
+static void ReleaseLocks(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    uint8_t i;
+    for (i = 0; i < mutex_count; ++i) {
+        if (mutexes[i].owner == task_id) {
+            MutexRelease(mutexes + i);
+        }
+    }
+    for (i = 0; i < rwlock_count; ++i) {
+        if (rwlocks[i].writer == task_id) {
+            rwlocks[i].writer = NO_TASK;
+        } else if (this_task->read_held & (1u << i)) {
+            this_task->read_held &= ~(1u << i);
+            rwlocks[i].readers--;
+        } else {
+            continue;
+        }
+        RwLockGrant(rwlocks + i);
+    }
+}
+
+/*
+ * Request a switch if the current task is no longer the one to run.
+ */
+static void Reschedule()
+{
+    if (!started) return;
+    uint8_t priority = 31 - _moyClz(ready_bitmap);
+    if (ready_head[priority] != current_task) {
+        _moyYield();
+    }
+}
+
+/*
+ * Allocate a stack from pool.
+ * Return its bottom, which is the highest address.
+ */
+moy_size* _moyAllocStack(uint32_t stack_size)
+{
+    moy_size *stack = moyMalloc(stack_size * sizeof(moy_size));
+    if (stack == 0) {
+        return 0;
+    }
+    return stack + stack_size;
+}
+
+/*
+ * Fill a stack with the paint pattern, so its use can be measured.
+ */
+static void PaintStack(moy_size *stack_bottom, moy_size stack_size)
+{
+    moy_size *word = stack_bottom - stack_size;
+    while (word < stack_bottom) {
+        *(word++) = MOY_STACK_PAINT;
+    }
+}
+
+/*
+ * Give the stack of a deleted task back to the pool.
+ */
+static void ReleaseStack(moy_task task_id)
+{
+    MoyTCB *this_task = tasks + task_id;
+    moyFree((moy_size *)this_task->stack_bottom - this_task->stack_size);
+    this_task->stack_size = 0;
+}
+
+/*
+ * Put the static tasks into the ready lists, once.
+ * Done before anything else touches the lists.
+ */
+static void LinkStaticTasks()
+{
+    if (static_linked) return;
+    moyEnterCritical();
+    moy_task i;
+    for (i = 0; i < MOY_STATIC_TASK_COUNT; ++i) {
+        ReadyPush(i);
+    }
+    static_linked = 1;
+    moyLeaveCritical();
+}
+
+/*
+ * Start everything.
+ * Static tasks, the idle one included, are ready to run already.
+ */
+void moyStart()
+{
+    LinkStaticTasks();
+
+    /* Start the OS */
+    _moyInitTicker();
+    _moySyscall(SYSCALL_START_OS, 0, 0, 0);
+}
+
+/*
+ * Check OS Status.
+ */
+uint8_t moyIsRunning()
+{
+    return started;
+}
+
+/*
+ * Sleep a time.
+ */
+void moyDelay(moy_size sleep_time)
+{
+    _moySyscall(SYSCALL_TASK_SLEEP, sleep_time, current_task, 0);
+    _moyYield();
+}
+
+/*
+ * Sleep some microseconds, independent of the tick.
+ * The task blocks and the precise timer wakes it. Without one, the wait
+ * is rounded up to whole ticks.
+ */
+void moyDelayUs(moy_size us)
+{
+    if (!started || us == 0) return;
+#if MOY_PRECISE_TIMER
+    moyEnterCritical();
+    MoyTCB *this_task = tasks + current_task;
+    this_task->wake_at = _moyTimerNow() + us;
+    ReadyRemove(current_task);
+    this_task->status = TASK_DELAYED_PRECISE;
+    if (PreciseInsert(current_task)) {
+        _moyTimerSet(this_task->wake_at);
+    }
+    moyLeaveCritical();
+    _moyYield();
+#else
+    moyDelay((us + MOY_SWITCH_INTERVAL * 1000 - 1) / (MOY_SWITCH_INTERVAL * 1000));
+#endif
+}
+
+/*
+ * Called by the port when the precise timer reaches the set time.
+ * Wake every sleeper due, and set the timer for the next one.
+ */
+void _moyTimerExpired()
+{
+#if MOY_PRECISE_TIMER
+    moyEnterCritical();
+    moy_size now = _moyTimerNow();
+    while (precise_head != NO_TASK
+            && (int32_t)(tasks[precise_head].wake_at - now) <= 0) {
+        moy_task task_id = precise_head;
+        precise_head = tasks[task_id].next;
+        if (precise_head != NO_TASK) {
+            tasks[precise_head].prev = NO_TASK;
+        }
+        MakeReady(task_id);
+    }
+    if (precise_head != NO_TASK) {
+        _moyTimerSet(tasks[precise_head].wake_at);
+    }
+    Reschedule();
+    moyLeaveCritical();
+#endif
+}
+
+/*
+ * Give up the rest of the time slice to tasks of the same priority.
+ */
+void moyYield()
+{
+    if (!started) return;
+    moyEnterCritical();
+    Rotate(current_task);
+    moyLeaveCritical();
+    _moyYield();
+}
+
+/*
+ * Set how many ticks a task may run before its peers get their turn.
+ */
+uint8_t moySetTimeSlice(moy_task handler, moy_size time_slice)
+{
+    if (handler >= task_count || time_slice == 0) {
+        return TASK_INVALID;
+    }
+    moyEnterCritical();
+    tasks[handler].time_slice = time_slice;
+    if (tasks[handler].slice_left > time_slice) {
+        tasks[handler].slice_left = time_slice;
+    }
+    moyLeaveCritical();
+    return TASK_OK;
+}
+
+/*
+ * Set up a TCB and make the task ready.
+ * Deadline and period are only meaningful in the EDF level.
+ */
+static uint8_t CreateTask(
+        TaskFunction entry,
+        const char *name,
+        moy_size stack_size,
+        void *parameters,
+        uint8_t priority,
+        moy_size deadline,
+        moy_size period,
+        moy_task *handler
+)
+{
+    LinkStaticTasks();
+    moyEnterCritical();
+    /* Reuse the slot of a deleted task, or take a new one */
+    moy_task task_id;
+    for (task_id = 0; task_id < task_count; ++task_id) {
+        if (tasks[task_id].status == 0 && tasks[task_id].stack_size == 0) break;
+    }
+    /* Check if reaching maximum task number */
+    if (task_id == MOY_STATIC_TASK_COUNT + MOY_TASK_SIZE) {
+        moyLeaveCritical();
+        return TASK_MAXIMUM_EXCEEDED;
+    }
+    /* Check if pool is full */
+    moy_size *stack_bottom = _moyAllocStack(stack_size);
+    if (stack_bottom == 0) {
+        moyLeaveCritical();
+        return TASK_MEM_POOL_FULL;
+    }
+    /* Set handler */
+    if (handler != 0) {
+        *handler = task_id;
+    }
+    /* Init TCB */
+    MoyTCB *this_task = tasks + task_id;
+    if (task_id == task_count) {
+        task_count++;
+    } else {
+        memset(this_task, 0, sizeof(MoyTCB));
+    }
+    this_task->stack_size = stack_size;
+    this_task->priority = priority;
+    this_task->base_priority = priority;
+    this_task->time_slice = MOY_TIME_SLICE;
+    this_task->slice_left = MOY_TIME_SLICE;
+    this_task->deadline = deadline;
+    this_task->period = period;
+    this_task->release = tick_count;
+    this_task->abs_deadline = tick_count + deadline;
+    this_task->stack_bottom = (moy_size)stack_bottom;
+    PaintStack(stack_bottom, stack_size);
+    _moyInitFrame(this_task, entry, parameters);
+    if (name != 0) {
+        strcpy(this_task->name, name);
+    }
+    MakeReady(task_id);
+    moyLeaveCritical();
+    return TASK_OK;
+}
+
+/*
+ * Create a task, and get a handler to operate it.
+ * Return a status code.
+ * Priority should be over 0, the level of the idle task,
+ * below MOY_PRIORITY_SIZE and not MOY_EDF_PRIORITY or MOY_JOB_PRIORITY.
+ */
+uint8_t moyCreateTask(
+        TaskFunction entry,
+        const char *name,
+        moy_size stack_size,
+        void *parameters,
+        uint8_t priority,
+        moy_task *handler
+)
+{
+    if (priority == 0 || priority >= MOY_PRIORITY_SIZE
+            || priority == MOY_EDF_PRIORITY || priority == MOY_JOB_PRIORITY) {
+        return TASK_INVALID;
+    }
+    return CreateTask(entry, name, stack_size, parameters, priority, 0, 0, handler);
+}
+
+/*
+ * Create a task in the EDF level.
+ * Its first job is released now and due in deadline ticks,
+ * later ones are released every period ticks by moyWaitPeriod.
+ */
+uint8_t moyCreateEdfTask(
+        TaskFunction entry,
+        const char *name,
+        moy_size stack_size,
+        void *parameters,
+        moy_size deadline,
+        moy_size period,
+        moy_task *handler
+)
+{
+    if (deadline == 0 || period == 0) {
+        return TASK_INVALID;
+    }
+    return CreateTask(entry, name, stack_size, parameters,
+                      MOY_EDF_PRIORITY, deadline, period, handler);
+}
+
+/*
+ * Account a finished job of the current task.
+ */
+static void RecordJob(MoyTCB *this_task)
+{
+    MoyJobStats *stats = &this_task->stats;
+    moy_size response = tick_count - this_task->release;
+
+    stats->jobs++;
+    stats->last_response = response;
+    if (response > stats->worst_response) {
+        stats->worst_response = response;
+    }
+    if ((int32_t)(tick_count - this_task->abs_deadline) > 0) {
+        stats->deadline_misses++;
+    }
+    if (response > this_task->period) {
+        stats->overruns++;
+    }
+}
+
+/*
+ * Move the current task to its next release and sleep until then.
+ * An overrunning task is released again at once.
+ */
+static void NextRelease(uint8_t job_done)
+{
+    moyEnterCritical();
+    MoyTCB *this_task = tasks + current_task;
+    if (job_done) {
+        RecordJob(this_task);
+    }
+    this_task->release += this_task->period;
+    moy_size sleep_ticks = this_task->release - tick_count;
+
+    /* The EDF list is sorted by deadline, so change it off the list. */
+    uint8_t edf = this_task->priority == MOY_EDF_PRIORITY;
+    if (edf || (int32_t)sleep_ticks > 0) {
+        ReadyRemove(current_task);
+    }
+    this_task->abs_deadline = this_task->release + this_task->deadline;
+    if ((int32_t)sleep_ticks <= 0) {
+        /* Overrun: released again at once, in its new place. */
+        if (edf) {
+            ReadyPush(current_task);
+            Reschedule();
+        }
+        moyLeaveCritical();
+        return;
+    }
+    this_task->sleep_time = sleep_ticks * MOY_SWITCH_INTERVAL;
+    this_task->status = TASK_DELAYED;
+    moyLeaveCritical();
+    _moyYield();
+}
+
+/*
+ * Finish the current job and sleep until the next release.
+ */
+void moyWaitPeriod()
+{
+    NextRelease(1);
+}
+
+/*
+ * Body of periodic tasks: run the job once per release.
+ */
+static void PeriodicBody()
+{
+    MoyTCB *this_task = tasks + current_task;
+
+    /* Wait for the first release, which is phase ticks after creation. */
+    NextRelease(0);
+    for (;;) {
+        this_task->job_entry(this_task->job_arg);
+        NextRelease(1);
+    }
+}
+
+/*
+ * Create a task whose entry is called once per period.
+ * The first job is released phase ticks from now, and each job should
+ * finish within deadline ticks of its release.
+ * Use MOY_EDF_PRIORITY to schedule it by deadline.
+ */
+uint8_t moyCreatePeriodicTask(
+        TaskFunction entry,
+        const char *name,
+        moy_size stack_size,
+        void *parameters,
+        uint8_t priority,
+        moy_size period,
+        moy_size deadline,
+        moy_size phase,
+        moy_task *handler
+)
+{
+    moy_task id;
+    uint8_t result;
+
+    if (priority == 0 || priority >= MOY_PRIORITY_SIZE || priority == MOY_JOB_PRIORITY
+            || period == 0 || deadline == 0) {
+        return TASK_INVALID;
+    }
+    moyEnterCritical();
+    result = CreateTask((TaskFunction)PeriodicBody, name, stack_size, 0,
+                        priority, deadline, period, &id);
+    if (result == TASK_OK) {
+        /* PeriodicBody adds one period before the first job. */
+        tasks[id].job_entry = entry;
+        tasks[id].job_arg = parameters;
+        tasks[id].release = tick_count + phase - period;
+        if (handler != 0) {
+            *handler = id;
+        }
+    }
+    moyLeaveCritical();
+    return result;
+}
+
+/*
+ * Get the timing statistics of a periodic task.
+ */
+uint8_t moyGetJobStats(moy_task handler, MoyJobStats *stats)
+{
+    if (handler >= task_count) {
+        return TASK_INVALID;
+    }
+    moyEnterCritical();
+    *stats = tasks[handler].stats;
+    moyLeaveCritical();
+    return TASK_OK;
+}
+
+/*
+ * Get the most stack a task has used so far, in words.
+ * Found by scanning up from the far end for the first overwritten word.
+ */
+moy_size moyGetStackHighWater(moy_task handler)
+{
+    if (handler >= task_count || tasks[handler].stack_size == 0) {
+        return 0;
+    }
+    MoyTCB *this_task = tasks + handler;
+    moy_size *stack_bottom = (moy_size *)this_task->stack_bottom;
+    moy_size *word = stack_bottom - this_task->stack_size;
+    while (word < stack_bottom && *word == MOY_STACK_PAINT) {
+        word++;
+    }
+    return stack_bottom - word;
+}
+
+/*
+ * Called when a task is found to have overflowed its stack.
+ * Memory next to the stack is already damaged, so stop here by default.
+ * Define it elsewhere to log or reset instead.
+ */
+__attribute__((weak)) void moyStackOverflowHook(moy_task handler)
+{
+    while (1);
+}
+
+/*
+ * Change the priority of a task, to a level allowed by moyCreateTask.
+ * A ready task is moved to the tail of its new level.
+ * A higher priority lent or inherited is kept until given back, which
+ * takes a pass over the mutexes and reader-writer locks.
+ */
+uint8_t moySetPriority(moy_task handler, uint8_t priority)
+{
+    LinkStaticTasks();
+    if (handler >= task_count || handler == idle_task_id || handler == job_host_id
+            || tasks[handler].status == 0
+            || priority == 0 || priority >= MOY_PRIORITY_SIZE
+            || priority == MOY_EDF_PRIORITY || priority == MOY_JOB_PRIORITY
+            || tasks[handler].base_priority == MOY_EDF_PRIORITY) {
+        return TASK_INVALID;
+    }
+    moyEnterCritical();
+    tasks[handler].base_priority = priority;
+    UpdatePriority(handler);
+    Reschedule();
+    moyLeaveCritical();
+    return TASK_OK;
+}
+
+/*
+ * Park a task until moyResume.
+ * Any delay or block in progress is dropped.
+ * The job host parks and resumes on its own, so it can't be suspended.
+ */
+uint8_t moySuspend(moy_task handler)
+{
+    LinkStaticTasks();
+    if (handler >= task_count || handler == idle_task_id || handler == job_host_id
+            || tasks[handler].status == 0) {
+        return TASK_INVALID;
+    }
+    moyEnterCritical();
+    if (tasks[handler].status == TASK_READY) {
+        ReadyRemove(handler);
+    }
+#if MOY_PRECISE_TIMER
+    if (tasks[handler].status == TASK_DELAYED_PRECISE) {
+        PreciseRemove(handler);
+    }
+#endif
+    if (tasks[handler].wait_list != 0) {
+        WaitCancel(handler);
+    }
+    /* A wait cut short ends as timed out once resumed. */
+    if (tasks[handler].status & TASK_TIMED_WAITS) {
+        tasks[handler].sleep_time = 0;
+    }
+    tasks[handler].status = TASK_SUSPENDED;
+    Reschedule();
+    moyLeaveCritical();
+    return TASK_OK;
+}
+
+/*
+ * Make a suspended task ready again.
+ */
+uint8_t moyResume(moy_task handler)
+{
+    LinkStaticTasks();
+    if (handler >= task_count || handler == job_host_id) {
+        return TASK_INVALID;
+    }
+    moyEnterCritical();
+    if (tasks[handler].status != TASK_SUSPENDED) {
+        moyLeaveCritical();
+        return TASK_INVALID;
+    }
+    MakeReady(handler);
+    Reschedule();
+    moyLeaveCritical();
+    return TASK_OK;
+}
+
+/*
+ * Del current task.
+ */
+void moyDelTask()
+{
+    if (!started) return;
+    moyDelTaskByID(current_task);
+    _moyYield();
+}
+
+/*
+ * Del a task by ID.
+ */
+void moyDelTaskByID(moy_task handler)
+{
+    LinkStaticTasks();
+    moyEnterCritical();
+    if (handler >= task_count || tasks[handler].status == 0) {
+        moyLeaveCritical();
+        return;
+    }
+    if (tasks[handler].status == TASK_READY) {
+        ReadyRemove(handler);
+    }
+#if MOY_PRECISE_TIMER
+    if (tasks[handler].status == TASK_DELAYED_PRECISE) {
+        PreciseRemove(handler);
+    }
+#endif
+    if (tasks[handler].wait_list != 0) {
+        WaitCancel(handler);
+    }
+    ReleaseLocks(handler);
+    tasks[handler].status = 0;
+    /* A task can't free the stack it runs on, the switch does it. */
+    if (!started || handler != current_task) {
+        ReleaseStack(handler);
+    }
+    moyLeaveCritical();
+}
+
+/*
+ * Find the next task to execute.
+ * It is the head of the highest non-empty ready list, or the partner
+ * of a call switched to directly if it is on that list.
+ * The idle task is always ready, so the bitmap is never empty.
+ */
+static inline MoyTCB* FindAvaTask()
+{
+    moyEnterCritical();
+    uint8_t priority = 31 - _moyClz(ready_bitmap);
+    if (direct_task != NO_TASK && tasks[direct_task].status == TASK_READY
+            && tasks[direct_task].priority == priority) {
+        current_task = direct_task;
+    } else {
+        current_task = ready_head[priority];
+    }
+    direct_task = NO_TASK;
+    MOY_TRACE_RUN(current_task);
+    moyLeaveCritical();
+    return tasks + current_task;
+}
+
+/*
+ * Run pending jobs above a ceiling, highest level first.
+ * Each job runs to completion with the ceiling raised to its level,
+ * so a job is only ever preempted by higher ones nested on the same stack.
+ */
+static void RunJobs(uint8_t ceiling)
+{
+    moyEnterCritical();
+    job_injected = 0;
+    while (job_bitmap != 0) {
+        uint8_t level = 31 - _moyClz(job_bitmap);
+        if (level <= ceiling) break;
+
+        uint8_t job_id = job_head[level];
+        MoyJob *this_job = jobs + job_id;
+        if (--this_job->pending == 0) {
+            job_head[level] = this_job->next;
+            if (job_head[level] == NO_JOB) {
+                job_bitmap &= ~(1u << level);
+            }
+        }
+
+        srp_ceiling = level;
+        moyLeaveCritical();
+        this_job->entry(this_job->parameters);
+        moyEnterCritical();
+    }
+    srp_ceiling = ceiling;
+    moyLeaveCritical();
+}
+
+/*
+ * Called on the job stack when a job is preempted outside the host.
+ * Runs the new jobs, then drops back to the preempted one.
+ */
+static void JobPreempt(moy_size stack_top)
+{
+    RunJobs(srp_ceiling);
+    _moySyscall(SYSCALL_JOB_RESUME, stack_top, 0, 0);
+}
+
+/*
+ * Body of the job host: run jobs, then park until activated again.
+ */
+static void JobHost()
+{
+    for (;;) {
+        RunJobs(0);
+        moyEnterCritical();
+        if (job_bitmap == 0) {
+            ReadyRemove(current_task);
+            tasks[current_task].status = TASK_SUSPENDED;
+            _moyYield();
+        }
+        moyLeaveCritical();
+    }
+}
+
+/*
+ * Create a run-to-completion job at a preemption level.
+ * Jobs share the stack of one host task instead of having their own,
+ * so they must return and never block.
+ */
+uint8_t moyCreateJob(TaskFunction entry, void *parameters, uint8_t level, uint8_t *handle)
+{
+    if (level == 0 || level > MOY_JOB_LEVEL_SIZE) {
+        return JOB_FAILED;
+    }
+    moyEnterCritical();
+    if (job_count == MOY_JOB_SIZE) {
+        moyLeaveCritical();
+        return JOB_MAXIMUM_EXCEEDED;
+    }
+    if (job_host_id == NO_TASK) {
+        uint8_t result = CreateTask((TaskFunction)JobHost, "jobs", MOY_JOB_STACK_SIZE,
+                                    0, MOY_JOB_PRIORITY, 0, 0, &job_host_id);
+        if (result != TASK_OK) {
+            moyLeaveCritical();
+            return result;
+        }
+    }
+    MoyJob *this_job = jobs + job_count;
+    this_job->entry = entry;
+    this_job->parameters = parameters;
+    this_job->level = level;
+    this_job->pending = 0;
+    *handle = job_count++;
+    moyLeaveCritical();
+    return JOB_OK;
+}
+
+/*
+ * Request a job to run. Safe to call from tasks, jobs and ISRs.
+ * From a job with a lower ceiling, the new job runs before this returns.
+ */
+uint8_t moyActivateJob(uint8_t job_id)
+{
+    if (job_id >= job_count) {
+        return JOB_FAILED;
+    }
+    moyEnterCritical();
+    MoyJob *this_job = jobs + job_id;
+    uint8_t level = this_job->level;
+    if (this_job->pending == (uint8_t)-1) {
+        moyLeaveCritical();
+        return JOB_FAILED;
+    }
+    if (this_job->pending++ == 0) {
+        /* Queue it behind other pending jobs of its level. */
+        this_job->next = NO_JOB;
+        if (job_bitmap & (1u << level)) {
+            jobs[job_tail[level]].next = job_id;
+        } else {
+            job_head[level] = job_id;
+            job_bitmap |= 1u << level;
+        }
+        job_tail[level] = job_id;
+    }
+
+    uint8_t nest = 0;
+    if (level <= srp_ceiling) {
+        /* It will run when the ceiling drops. */
+    } else if (tasks[job_host_id].status == TASK_SUSPENDED) {
+        MakeReady(job_host_id);
+        Reschedule();
+    } else if (!started) {
+        /* The host runs it once the OS starts. */
+    } else if (current_task == job_host_id && !_moyInHandler()) {
+        /* Called from a job, nest the new one right here. */
+        nest = 1;
+    } else {
+        /* A job is in progress, preempt it when the host runs next. */
+        _moyYield();
+    }
+    moyLeaveCritical();
+
+    if (nest) {
+        RunJobs(srp_ceiling);
+    }
+    return JOB_OK;
+}
+
+/*
+ * Raise the ceiling while a job uses a resource shared with jobs up to that level.
+ * Return the previous ceiling, to be given back to moySrpUnlock.
+ */
+uint8_t moySrpLock(uint8_t ceiling)
+{
+    moyEnterCritical();
+    uint8_t previous = srp_ceiling;
+    if (ceiling > srp_ceiling) {
+        srp_ceiling = ceiling;
+    }
+    moyLeaveCritical();
+    return previous;
+}
+
+/*
+ * Restore the ceiling and run the jobs it held back.
+ */
+void moySrpUnlock(uint8_t previous)
+{
+    RunJobs(previous);
+}
+
+/*
+ * Ticks since the OS started.
+ */
+moy_size moyGetTicks()
+{
+    return tick_count;
+}
+
+/*
+ * Cycles since the counter started, extended to 64 bits.
+ * The tick reads it often enough not to miss a wrap.
+ */
+uint64_t moyNowCycles()
+{
+    moyEnterCritical();
+    uint32_t low = _moyCycleCount();
+    if (low < cycle_last) {
+        cycle_high++;
+    }
+    cycle_last = low;
+    uint64_t now = ((uint64_t)cycle_high << 32) | low;
+    moyLeaveCritical();
+    return now;
+}
+
+/*
+ * Microseconds since the counter started.
+ */
+uint64_t moyNowUs()
+{
+    return moyNowCycles() / (_moyCycleFrequency() / 1000000);
+}
+
+/*
+ * Should be called every tick.
+ * Deal with sleep and block.
+ */
+void _moyTick()
+{
+    moyEnterCritical();
+    tick_count++;
+    /* Read the cycle counter at least once per wrap. */
+    moyNowCycles();
+    int i;
+    for (i = 0; i < task_count; ++i) {
+        MoyTCB *this_task = tasks + i;
+        /* Deal with waiting */
+        /* A wait timed out has no time left, a wait ended early keeps some. */
+        if (this_task->status & TASK_TIMED_WAITS) {
+            if (this_task->sleep_time <= MOY_SWITCH_INTERVAL) {
+                this_task->sleep_time = 0;
+                MakeReady(i);
+            } else {
+                this_task->sleep_time -= MOY_SWITCH_INTERVAL;
+            }
+        }
+    }
+
+    /* Charge the running task, and let its peers run when its slice is used up. */
+    /* The EDF level is ordered by deadline, so it is never rotated. */
+    MoyTCB *running = tasks + current_task;
+    if (running->status == TASK_READY && running->priority != MOY_EDF_PRIORITY
+            && --running->slice_left == 0) {
+        Rotate(current_task);
+    }
+    moyLeaveCritical();
+}
+
+/*
+ * Should be called when switch occurs.
+ * Save the stack top and return the next stack top.
+ */
+moy_size _moySwitch(moy_size stack_top)
+{
+    /* A preempting job has finished, drop its frames. */
+    if (job_resume_top != 0) {
+        stack_top = job_resume_top;
+        job_resume_top = 0;
+    }
+
+    /* Update the stack top */
+    tasks[current_task].stack_top = stack_top;
+
+#if MOY_STACK_CHECK
+    /* Cheap overflow check: the last word and the saved stack top. */
+    MoyTCB *prev_task = tasks + current_task;
+    if (prev_task->status != 0) {
+        moy_size *stack_end = (moy_size *)prev_task->stack_bottom - prev_task->stack_size;
+        if (*stack_end != MOY_STACK_PAINT || stack_top < (moy_size)stack_end) {
+            moyStackOverflowHook(current_task);
+        }
+    }
+#endif
+
+    /* Off the stack of a task that deleted itself, free it now. */
+    if (tasks[current_task].status == 0 && tasks[current_task].stack_size != 0) {
+        ReleaseStack(current_task);
+    }
+
+    MoyTCB *next_task = FindAvaTask();
+
+    /* Run jobs above the ceiling on top of the job in progress. */
+    if (current_task == job_host_id && srp_ceiling != 0 && !job_injected
+            && job_bitmap != 0 && 31 - _moyClz(job_bitmap) > srp_ceiling) {
+        job_injected = 1;
+        _moyInjectCall(next_task, (TaskFunction)JobPreempt, (void *)next_task->stack_top);
+    }
+
+    return next_task->stack_top;
+}
+
+/*
+ * Pend the IRQ task fed by a queue.
+ */
+static inline void NotifyIrqTask(MoyQueue *this_queue)
+{
+    if (this_queue->irq_task != 0) {
+        _moyPendIrq(irq_tasks[this_queue->irq_task - 1].irq);
+    }
+}
+
+/*
+ * Create a task run as the handler of an unused interrupt line.
+ * The NVIC picks and preempts such tasks by priority, and they all run on
+ * the main stack, so entry must return and never block.
+ * Higher priority preempts lower, and every IRQ task preempts normal tasks.
+ */
+uint8_t moyCreateIrqTask(
+        TaskFunction entry,
+        void *parameters,
+        uint8_t irq,
+        uint8_t priority,
+        uint8_t *handle
+)
+{
+    if (irq >= MOY_IRQ_LINE_SIZE || priority == 0 || priority > MOY_IRQ_PRIORITY_SIZE) {
+        return TASK_INVALID;
+    }
+    moyEnterCritical();
+    if (irq_task_count == MOY_IRQ_TASK_SIZE) {
+        moyLeaveCritical();
+        return TASK_MAXIMUM_EXCEEDED;
+    }
+    if (irq_task_map[irq] != 0 || _moyIrqInUse(irq)) {
+        moyLeaveCritical();
+        return TASK_INVALID;
+    }
+    MoyIrqTask *this_task = irq_tasks + irq_task_count;
+    this_task->entry = entry;
+    this_task->parameters = parameters;
+    this_task->irq = irq;
+    *handle = irq_task_count++;
+    irq_task_map[irq] = irq_task_count;
+    _moyBindIrq(irq, priority);
+    moyLeaveCritical();
+    return TASK_OK;
+}
+
+/*
+ * Request an IRQ task to run. Safe to call from anywhere.
+ */
+uint8_t moyPendIrqTask(uint8_t handle)
+{
+    if (handle >= irq_task_count) {
+        return TASK_INVALID;
+    }
+    _moyPendIrq(irq_tasks[handle].irq);
+    return TASK_OK;
+}
+
+/*
+ * Pend an IRQ task whenever an item is pushed into a queue.
+ * The task should pull with no timeout until the queue is empty.
+ */
+uint8_t moyQueueBindIrqTask(uint8_t queue_id, uint8_t handle)
+{
+    if (queue_id >= queue_count || handle >= irq_task_count) {
+        return QUEUE_FAILED;
+    }
+    moyEnterCritical();
+    queues[queue_id].irq_task = handle + 1;
+    if (queues[queue_id].status == QUEUE_FILLED) {
+        _moyPendIrq(irq_tasks[handle].irq);
+    }
+    moyLeaveCritical();
+    return QUEUE_OK;
+}
+
+/*
+ * Called by the port on an interrupt line bound to an IRQ task.
+ */
+void _moyIrqTaskRun(uint8_t irq)
+{
+    uint8_t handle = irq_task_map[irq];
+    if (handle == 0) return;
+    MoyIrqTask *this_task = irq_tasks + handle - 1;
+    this_task->entry(this_task->parameters);
+}
+
+/*
+ * Create a queue.
+ */
+uint8_t moyCreateQueue(uint8_t *handle)
+{
+    moyEnterCritical();
+    if (queue_count == MOY_STATIC_QUEUE_COUNT + MOY_QUEUE_SIZE) {
+        moyLeaveCritical();
+        return QUEUE_MAXIMUM_EXCEEDED;
+    }
+    queues[queue_count].status = QUEUE_EMPTY;
+    queues[queue_count].irq_task = 0;
+    queues[queue_count].slots = 0;
+    queues[queue_count].readers.first = 0;
+    queues[queue_count].writers.first = 0;
+    *handle = queue_count++;
+    moyLeaveCritical();
+    return QUEUE_OK;
+}
+
+/*
+ * Push an item into a queue.
+ * Set timeout to 0 for no waiting.
+ */
+uint8_t moyQueuePush(uint8_t queue_id, moy_size item, moy_size timeout)
+{
+    MoyQueue *this_queue = queues + queue_id;
+    if (this_queue->slots != 0) {
+        return QUEUE_FAILED;
+    }
+    moyEnterCritical();
+
+    /* If empty, just write and return. */
+    if (this_queue->status == QUEUE_EMPTY) {
+        this_queue->item_ptr = item;
+        this_queue->status = QUEUE_FILLED;
+        WakeWaiter(&this_queue->readers);
+        NotifyIrqTask(this_queue);
+        Reschedule();
+        moyLeaveCritical();
+        return QUEUE_OK;
+    }
+
+    /* Not empty, wait or fail. Handlers can't wait. */
+    if (!timeout || _moyInHandler()) {
+        moyLeaveCritical();
+        return QUEUE_FAILED;
+    }
+    BlockCurrent(TASK_BLOCKED_WRITING_QUEUE, &this_queue->writers, timeout);
+    moyLeaveCritical();
+    _moyYield();
+
+    /* Now the block has been removed. Let's check the queue. */
+    moyEnterCritical();
+    if (this_queue->status == QUEUE_EMPTY) {
+        this_queue->item_ptr = item;
+        this_queue->status = QUEUE_FILLED;
+        WakeWaiter(&this_queue->readers);
+        NotifyIrqTask(this_queue);
+        Reschedule();
+        moyLeaveCritical();
+        return QUEUE_OK;
+    }
+    moyLeaveCritical();
+    return QUEUE_FAILED;
+}
+
+/*
+ * Pull an item from a queue.
+ * Set timeout to 0 for no waiting.
+ */
+uint8_t moyQueuePull(uint8_t queue_id, moy_size *item_ptr, moy_size timeout)
+{
+    MoyQueue *this_queue = queues + queue_id;
+    if (this_queue->slots != 0) {
+        return QUEUE_FAILED;
+    }
+    moyEnterCritical();
+
+    /* If empty, just write and return. */
+    if (this_queue->status == QUEUE_FILLED) {
+        *item_ptr = this_queue->item_ptr;
+        this_queue->status = QUEUE_EMPTY;
+        WakeWaiter(&this_queue->writers);
+        Reschedule();
+        moyLeaveCritical();
+        return QUEUE_OK;
+    }
+
+    /* Not empty, wait or fail. Handlers can't wait. */
+    if (!timeout || _moyInHandler()) {
+        moyLeaveCritical();
+        return QUEUE_FAILED;
+    }
+    BlockCurrent(TASK_BLOCKED_READING_QUEUE, &this_queue->readers, timeout);
+    moyLeaveCritical();
+    _moyYield();
+
+    /* Now the block has been removed. Let's check the queue. */
+    moyEnterCritical();
+    if (this_queue->status == QUEUE_FILLED) {
+        *item_ptr = this_queue->item_ptr;
+        this_queue->status = QUEUE_EMPTY;
+        WakeWaiter(&this_queue->writers);
+        Reschedule();
+        moyLeaveCritical();
+        return QUEUE_OK;
+    }
+    moyLeaveCritical();
+    return QUEUE_FAILED;
+}
+
+/*
+ * Create a queue of depth slots of slot_size bytes, from the heap.
+ * Items are written and read in place, with moyQueueReserve and
+ * moyQueueCommit, then moyQueuePeekSlot and moyQueueRelease.
+ * Slots are 8-byte aligned. moyQueuePush and moyQueuePull don't apply.
+ */
+uint8_t moyCreateSlotQueue(moy_size slot_size, moy_size depth, uint8_t *handle)
+{
+    if (slot_size == 0 || depth == 0) {
+        return QUEUE_FAILED;
+    }
+    moy_size stride = (slot_size + 7) & ~(moy_size)7;
+    moyEnterCritical();
+    if (queue_count == MOY_STATIC_QUEUE_COUNT + MOY_QUEUE_SIZE) {
+        moyLeaveCritical();
+        return QUEUE_MAXIMUM_EXCEEDED;
+    }
+    uint8_t *slots = moyMalloc(stride * depth);
+    if (slots == 0) {
+        moyLeaveCritical();
+        return QUEUE_MEM_POOL_FULL;
+    }
+    MoyQueue *this_queue = queues + queue_count;
+    this_queue->status = QUEUE_EMPTY;
+    this_queue->irq_task = 0;
+    this_queue->slots = slots;
+    this_queue->slot_stride = stride;
+    this_queue->depth = depth;
+    this_queue->head = 0;
+    this_queue->count = 0;
+    this_queue->reserved = 0;
+    this_queue->peeked = 0;
+    this_queue->readers.first = 0;
+    this_queue->writers.first = 0;
+    *handle = queue_count++;
+    moyLeaveCritical();
+    return QUEUE_OK;
+}
+
+/*
+ * Check if a slot queue has a free slot to reserve, or an item to peek.
+ */
+static inline uint8_t SlotReady(MoyQueue *this_queue, uint16_t status)
+{
+    if (status == TASK_BLOCKED_WRITING_QUEUE) {
+        return !this_queue->reserved && this_queue->count < this_queue->depth;
+    }
+    return !this_queue->peeked && this_queue->count != 0;
+}
+
+/*
+ * Wait until a slot queue is ready, blocked as status.
+ * Called and returns in the critical section. Return 0 on timeout.
+ */
+static uint8_t SlotWait(uint8_t queue_id, uint16_t status, moy_size timeout)
+{
+    MoyQueue *this_queue = queues + queue_id;
+    while (!SlotReady(this_queue, status)) {
+        /* Handlers can't wait. */
+        if (!timeout || _moyInHandler()) {
+            return 0;
+        }
+        BlockCurrent(status, status == TASK_BLOCKED_WRITING_QUEUE
+                ? &this_queue->writers : &this_queue->readers, timeout);
+        moyLeaveCritical();
+        _moyYield();
+        moyEnterCritical();
+
+        /* Taken by another task first, wait again with the time left. */
+        timeout = tasks[current_task].sleep_time;
+    }
+    return 1;
+}
+
+/*
+ * Wake a reader if an item is there to peek, and a writer if a slot is
+ * free to reserve.
+ */
+static void SlotWake(MoyQueue *this_queue)
+{
+    if (SlotReady(this_queue, TASK_BLOCKED_READING_QUEUE)) {
+        WakeWaiter(&this_queue->readers);
+    }
+    if (SlotReady(this_queue, TASK_BLOCKED_WRITING_QUEUE)) {
+        WakeWaiter(&this_queue->writers);
+    }
+}
+
+/*
+ * Get the next free slot of a slot queue to build an item in.
+ * The write end is held until moyQueueCommit.
+ * Set timeout to 0 for no waiting.
+ */
+uint8_t moyQueueReserve(uint8_t queue_id, void **slot, moy_size timeout)
+{
+    if (queue_id >= queue_count || queues[queue_id].slots == 0) {
+        return QUEUE_FAILED;
+    }
+    MoyQueue *this_queue = queues + queue_id;
+    moyEnterCritical();
+    if (!SlotWait(queue_id, TASK_BLOCKED_WRITING_QUEUE, timeout)) {
+        moyLeaveCritical();
+        return QUEUE_FAILED;
+    }
+    moy_size tail = this_queue->head + this_queue->count;
+    if (tail >= this_queue->depth) {
+        tail -= this_queue->depth;
+    }
+    this_queue->reserved = 1;
+    *slot = this_queue->slots + tail * this_queue->slot_stride;
+    moyLeaveCritical();
+    return QUEUE_OK;
+}
+
+/*
+ * Publish the reserved slot to readers.
+ */
+uint8_t moyQueueCommit(uint8_t queue_id)
+{
+    if (queue_id >= queue_count) {
+        return QUEUE_FAILED;
+    }
+    MoyQueue *this_queue = queues + queue_id;
+    moyEnterCritical();
+    if (!this_queue->reserved) {
+        moyLeaveCritical();
+        return QUEUE_FAILED;
+    }
+    this_queue->reserved = 0;
+    this_queue->count++;
+    this_queue->status = QUEUE_FILLED;
+    SlotWake(this_queue);
+    NotifyIrqTask(this_queue);
+    Reschedule();
+    moyLeaveCritical();
+    return QUEUE_OK;
+}
+
+/*
+ * Get the oldest item of a slot queue, to read it in place.
+ * The read end is held until moyQueueRelease.
+ * Set timeout to 0 for no waiting.
+ */
+uint8_t moyQueuePeekSlot(uint8_t queue_id, void **slot, moy_size timeout)
+{
+    if (queue_id >= queue_count || queues[queue_id].slots == 0) {
+        return QUEUE_FAILED;
+    }
+    MoyQueue *this_queue = queues + queue_id;
+    moyEnterCritical();
+    if (!SlotWait(queue_id, TASK_BLOCKED_READING_QUEUE, timeout)) {
+        moyLeaveCritical();
+        return QUEUE_FAILED;
+    }
+    this_queue->peeked = 1;
+    *slot = this_queue->slots + this_queue->head * this_queue->slot_stride;
+    moyLeaveCritical();
+    return QUEUE_OK;
+}
+
+/*
+ * Drop the item got by moyQueuePeekSlot, freeing its slot for writers.
+ */
+uint8_t moyQueueRelease(uint8_t queue_id)
+{
+    if (queue_id >= queue_count) {
+        return QUEUE_FAILED;
+    }
+    MoyQueue *this_queue = queues + queue_id;
+    moyEnterCritical();
+    if (!this_queue->peeked) {
+        moyLeaveCritical();
+        return QUEUE_FAILED;
+    }
+    this_queue->peeked = 0;
+    this_queue->count--;
+    if (++this_queue->head == this_queue->depth) {
+        this_queue->head = 0;
+    }
+    if (this_queue->count == 0) {
+        this_queue->status = QUEUE_EMPTY;
+    }
+    SlotWake(this_queue);
+    Reschedule();
+    moyLeaveCritical();
+    return QUEUE_OK;
+}
+
+/*
+ * Create a pool of count message buffers of msg_size bytes, from the heap.
+ * Buffers are 8-byte aligned, each behind a header of its own.
+ */
+uint8_t moyCreateMsgPool(moy_size msg_size, moy_size count, uint8_t *handle)
+{
+    if (msg_size == 0 || count == 0) {
+        return MSG_FAILED;
+    }
+    moy_size stride = sizeof(MoyMsgHeader) + ((msg_size + 7) & ~(moy_size)7);
+    moyEnterCritical();
+    if (msg_pool_count == MOY_MSG_POOL_SIZE) {
+        moyLeaveCritical();
+        return MSG_MAXIMUM_EXCEEDED;
+    }
+    uint8_t *storage = moyMalloc(stride * count);
+    if (storage == 0) {
+        moyLeaveCritical();
+        return MSG_MEM_POOL_FULL;
+    }
+
+    /* Chain the buffers in address order. */
+    MoyMsgPool *this_pool = msg_pools + msg_pool_count;
+    this_pool->storage = storage;
+    this_pool->stride = stride;
+    this_pool->count = count;
+    this_pool->free_count = count;
+    this_pool->free_head = 0;
+    this_pool->waiters.first = 0;
+    moy_size i = count;
+    while (i-- > 0) {
+        MoyMsgHeader *header = (MoyMsgHeader *)(storage + i * stride);
+        header->pool = 0;
+        header->next = this_pool->free_head;
+        this_pool->free_head = header;
+    }
+    *handle = msg_pool_count++;
+    moyLeaveCritical();
+    return MSG_OK;
+}
+
+/*
+ * Find the header of an allocated buffer, or 0 if msg is not one.
+ */
+static MoyMsgHeader *MsgHeader(void *msg)
+{
+    MoyMsgHeader *header = (MoyMsgHeader *)msg - 1;
+    if (msg == 0 || header->pool == 0 || header->pool > msg_pool_count) {
+        return 0;
+    }
+    MoyMsgPool *this_pool = msg_pools + header->pool - 1;
+    moy_size offset = (uint8_t *)header - this_pool->storage;
+    if ((uint8_t *)header < this_pool->storage
+            || offset >= this_pool->stride * this_pool->count
+            || offset % this_pool->stride != 0) {
+        return 0;
+    }
+    return header;
+}
+
+/*
+ * Take a buffer from a pool. The caller owns it until it is sent or freed.
+ * Set timeout to 0 for no waiting.
+ */
+uint8_t moyMsgAlloc(uint8_t pool_id, void **msg, moy_size timeout)
+{
+    if (pool_id >= msg_pool_count) {
+        return MSG_FAILED;
+    }
+    MoyMsgPool *this_pool = msg_pools + pool_id;
+    moyEnterCritical();
+
+    /* All taken, wait or fail. Handlers can't wait. */
+    if (this_pool->free_head == 0) {
+        if (!timeout || _moyInHandler()) {
+            moyLeaveCritical();
+            return MSG_FAILED;
+        }
+        BlockCurrent(TASK_BLOCKED_MSG_ALLOC, &this_pool->waiters, timeout);
+        moyLeaveCritical();
+        _moyYield();
+
+        /* Woken by a free or timed out. */
+        moyEnterCritical();
+        if (this_pool->free_head == 0) {
+            moyLeaveCritical();
+            return MSG_FAILED;
+        }
+    }
+
+    MoyMsgHeader *header = this_pool->free_head;
+    this_pool->free_head = header->next;
+    this_pool->free_count--;
+    header->pool = pool_id + 1;
+    header->refs = 1;
+    moyLeaveCritical();
+    *msg = header + 1;
+    return MSG_OK;
+}
+
+/*
+ * Drop a reference to a buffer, giving it back to its pool with the last.
+ * Called in the critical section.
+ */
+static void MsgRelease(MoyMsgHeader *header)
+{
+    if (--header->refs != 0) return;
+    uint8_t pool_id = header->pool - 1;
+    MoyMsgPool *this_pool = msg_pools + pool_id;
+    header->pool = 0;
+    header->next = this_pool->free_head;
+    this_pool->free_head = header;
+    this_pool->free_count++;
+    WakeWaiter(&this_pool->waiters);
+}
+
+/*
+ * Give a buffer back to its pool, waking a task waiting for one.
+ * A published buffer goes back once every holder has freed it.
+ * Safe to call from handlers. Freeing a buffer twice fails.
+ */
+uint8_t moyMsgFree(void *msg)
+{
+    moyEnterCritical();
+    MoyMsgHeader *header = MsgHeader(msg);
+    if (header == 0) {
+        moyLeaveCritical();
+        return MSG_FAILED;
+    }
+    MsgRelease(header);
+    Reschedule();
+    moyLeaveCritical();
+    return MSG_OK;
+}
+
+/*
+ * Pass a buffer through a queue, along with its ownership.
+ * The sender must not touch it afterwards, unless this fails.
+ */
+uint8_t moyMsgSend(uint8_t queue_id, void *msg, moy_size timeout)
+{
+    if (MsgHeader(msg) == 0) {
+        return MSG_FAILED;
+    }
+    if (moyQueuePush(queue_id, (moy_size)msg, timeout) != QUEUE_OK) {
+        return MSG_FAILED;
+    }
+    return MSG_OK;
+}
+
+/*
+ * Take a buffer from a queue. The receiver owns it, and should free it.
+ */
+uint8_t moyMsgReceive(uint8_t queue_id, void **msg, moy_size timeout)
+{
+    moy_size item;
+    if (moyQueuePull(queue_id, &item, timeout) != QUEUE_OK) {
+        return MSG_FAILED;
+    }
+    *msg = (void *)item;
+    return MSG_OK;
+}
+
+/*
+ * Create a topic, with no subscribers yet.
+ */
+uint8_t moyCreateTopic(uint8_t *handle)
+{
+    moyEnterCritical();
+    if (topic_count == MOY_TOPIC_SIZE) {
+        moyLeaveCritical();
+        return TOPIC_MAXIMUM_EXCEEDED;
+    }
+    topics[topic_count].subscriber_count = 0;
+    topics[topic_count].drops = 0;
+    *handle = topic_count++;
+    moyLeaveCritical();
+    return TOPIC_OK;
+}
+
+/*
+ * Subscribe to a topic through a new queue of depth messages.
+ * When it is full, a message published drops the newest, that is itself,
+ * or the oldest one queued, by policy.
+ * Read it with moyTopicReceive, or bind it to an IRQ task.
+ */
+uint8_t moySubscribe(uint8_t topic_id, moy_size depth, uint8_t policy, uint8_t *queue_handle)
+{
+    if (topic_id >= topic_count || policy > TOPIC_DROP_OLDEST) {
+        return TOPIC_FAILED;
+    }
+    MoyTopic *this_topic = topics + topic_id;
+    if (this_topic->subscriber_count == MOY_TOPIC_SUBSCRIBER_SIZE) {
+        return TOPIC_MAXIMUM_EXCEEDED;
+    }
+    uint8_t queue_id;
+    if (moyCreateSlotQueue(sizeof(void *), depth, &queue_id) != QUEUE_OK) {
+        return TOPIC_FAILED;
+    }
+    moyEnterCritical();
+    if (this_topic->subscriber_count == MOY_TOPIC_SUBSCRIBER_SIZE) {
+        moyLeaveCritical();
+        return TOPIC_MAXIMUM_EXCEEDED;
+    }
+    this_topic->queues[this_topic->subscriber_count] = queue_id;
+    this_topic->policies[this_topic->subscriber_count] = policy;
+    this_topic->subscriber_count++;
+    *queue_handle = queue_id;
+    moyLeaveCritical();
+    return TOPIC_OK;
+}
+
+/*
+ * Post a buffer of a message pool to every subscriber, without copying.
+ * The publisher gives up its reference, and each subscriber gets one.
+ * Never waits, so safe to call from handlers.
+ */
+uint8_t moyPublish(uint8_t topic_id, void *msg)
+{
+    if (topic_id >= topic_count) {
+        return TOPIC_FAILED;
+    }
+    MoyTopic *this_topic = topics + topic_id;
+    moyEnterCritical();
+    MoyMsgHeader *header = MsgHeader(msg);
+    if (header == 0) {
+        moyLeaveCritical();
+        return TOPIC_FAILED;
+    }
+    uint8_t i;
+    for (i = 0; i < this_topic->subscriber_count; ++i) {
+        uint8_t queue_id = this_topic->queues[i];
+        MoyQueue *this_queue = queues + queue_id;
+
+        /* Full: drop the oldest unless it is being read, else this one. */
+        if (this_queue->count + this_queue->reserved == this_queue->depth) {
+            this_topic->drops++;
+            if (this_topic->policies[i] != TOPIC_DROP_OLDEST
+                    || this_queue->peeked || this_queue->count == 0) {
+                continue;
+            }
+            MsgRelease(*(MoyMsgHeader **)(this_queue->slots
+                    + this_queue->head * this_queue->slot_stride) - 1);
+            this_queue->count--;
+            if (++this_queue->head == this_queue->depth) {
+                this_queue->head = 0;
+            }
+        }
+
+        moy_size tail = this_queue->head + this_queue->count;
+        if (tail >= this_queue->depth) {
+            tail -= this_queue->depth;
+        }
+        *(void **)(this_queue->slots + tail * this_queue->slot_stride) = msg;
+        header->refs++;
+        this_queue->count++;
+        this_queue->status = QUEUE_FILLED;
+        WakeWaiter(&this_queue->readers);
+        NotifyIrqTask(this_queue);
+    }
+    MsgRelease(header);
+    Reschedule();
+    moyLeaveCritical();
+    return TOPIC_OK;
+}
+
+/*
+ * Take the next message from a subscriber queue.
+ * The subscriber holds a reference, and should moyMsgFree it when done.
+ * Set timeout to 0 for no waiting.
+ */
+uint8_t moyTopicReceive(uint8_t queue_id, void **msg, moy_size timeout)
+{
+    void *slot;
+    if (moyQueuePeekSlot(queue_id, &slot, timeout) != QUEUE_OK) {
+        return TOPIC_FAILED;
+    }
+    *msg = *(void **)slot;
+    moyQueueRelease(queue_id);
+    return TOPIC_OK;
+}
+
+/*
+ * Create a mailbox for a value of size bytes, kept twice in the heap.
+ */
+uint8_t moyCreateMailbox(moy_size size, uint8_t *handle)
+{
+    if (size == 0) {
+        return MAILBOX_FAILED;
+    }
+    moy_size stride = (size + 7) & ~(moy_size)7;
+    moyEnterCritical();
+    if (mailbox_count == MOY_MAILBOX_SIZE) {
+        moyLeaveCritical();
+        return MAILBOX_MAXIMUM_EXCEEDED;
+    }
+    uint8_t *copies = moyMalloc(stride * 2);
+    if (copies == 0) {
+        moyLeaveCritical();
+        return MAILBOX_MEM_POOL_FULL;
+    }
+    MoyMailbox *this_mailbox = mailboxes + mailbox_count;
+    this_mailbox->sequence = 0;
+    this_mailbox->copies = copies;
+    this_mailbox->size = size;
+    *handle = mailbox_count++;
+    moyLeaveCritical();
+    return MAILBOX_OK;
+}
+
+/*
+ * Replace the value of a mailbox. Never waits nor masks interrupts.
+ * A mailbox has one writer, or writers that can't preempt each other.
+ *
+ * The sequence is odd while the first copy is written, and even while
+ * the second is, so readers always have a whole copy to take: even one
+ * preempting the writer halfway.
+ */
+uint8_t moyMailboxWrite(uint8_t mailbox_id, const void *data)
+{
+    if (mailbox_id >= mailbox_count) {
+        return MAILBOX_FAILED;
+    }
+    MoyMailbox *this_mailbox = mailboxes + mailbox_id;
+    moy_size stride = (this_mailbox->size + 7) & ~(moy_size)7;
+    this_mailbox->sequence++;
+    _moyMemoryBarrier();
+    memcpy(this_mailbox->copies, data, this_mailbox->size);
+    _moyMemoryBarrier();
+    this_mailbox->sequence++;
+    _moyMemoryBarrier();
+    memcpy(this_mailbox->copies + stride, data, this_mailbox->size);
+    _moyMemoryBarrier();
+    return MAILBOX_OK;
+}
+
+/*
+ * Copy the latest value of a mailbox, retried if a write overtakes it.
+ * Never waits nor masks interrupts. Set version to get the number of
+ * writes the value comes from, or to 0.
+ */
+uint8_t moyMailboxRead(uint8_t mailbox_id, void *data, moy_size *version)
+{
+    if (mailbox_id >= mailbox_count) {
+        return MAILBOX_FAILED;
+    }
+    MoyMailbox *this_mailbox = mailboxes + mailbox_id;
+    moy_size stride = (this_mailbox->size + 7) & ~(moy_size)7;
+    moy_size sequence;
+    do {
+        sequence = this_mailbox->sequence;
+        /* Not a whole copy yet before the first write ends. */
+        if (sequence < 2) {
+            return MAILBOX_EMPTY;
+        }
+        _moyMemoryBarrier();
+        /* Odd: the first copy is being written, take the second. */
+        memcpy(data, this_mailbox->copies + (sequence & 1) * stride, this_mailbox->size);
+        _moyMemoryBarrier();
+    } while (this_mailbox->sequence != sequence);
+    if (version != 0) {
+        *version = sequence / 2;
+    }
+    return MAILBOX_OK;
+}
+
+/* Set in the middle word of a triple buffer when it holds a new frame. */
+#define TRIPLE_FRESH 4u
+
+/*
+ * Create a triple buffer of three buffers of size bytes from the heap.
+ */
+uint8_t moyCreateTripleBuffer(moy_size size, uint8_t *handle)
+{
+    if (size == 0) {
+        return TRIPLE_FAILED;
+    }
+    moy_size stride = (size + 7) & ~(moy_size)7;
+    moyEnterCritical();
+    if (triple_count == MOY_TRIPLE_SIZE) {
+        moyLeaveCritical();
+        return TRIPLE_MAXIMUM_EXCEEDED;
+    }
+    uint8_t *buffers = moyMalloc(stride * 3);
+    if (buffers == 0) {
+        moyLeaveCritical();
+        return TRIPLE_MEM_POOL_FULL;
+    }
+    MoyTriple *this_triple = triples + triple_count;
+    this_triple->buffers = buffers;
+    this_triple->stride = stride;
+    this_triple->front = 0;
+    this_triple->middle = 1;
+    this_triple->back = 2;
+    this_triple->received = 0;
+    *handle = triple_count++;
+    moyLeaveCritical();
+    return TRIPLE_OK;
+}
+
+/*
+ * Get the buffer the producer fills, always free for it.
+ */
+void *moyTripleBack(uint8_t triple_id)
+{
+    if (triple_id >= triple_count) {
+        return 0;
+    }
+    MoyTriple *this_triple = triples + triple_id;
+    return this_triple->buffers + this_triple->back * this_triple->stride;
+}
+
+/*
+ * Hand the filled back buffer over as the newest frame, and take the
+ * middle one as the next back buffer. Never waits nor masks interrupts.
+ */
+uint8_t moyTriplePublish(uint8_t triple_id)
+{
+    if (triple_id >= triple_count) {
+        return TRIPLE_FAILED;
+    }
+    MoyTriple *this_triple = triples + triple_id;
+    _moyMemoryBarrier();
+    uint32_t old = _moyAtomicExchange(&this_triple->middle, this_triple->back | TRIPLE_FRESH);
+    this_triple->back = old & ~TRIPLE_FRESH;
+    return TRIPLE_OK;
+}
+
+/*
+ * Get the newest frame published for the consumer, to read in place.
+ * It stays the consumer's until the next call. Never waits nor masks
+ * interrupts. Return TRIPLE_STALE if nothing newer came since.
+ */
+uint8_t moyTripleLatest(uint8_t triple_id, void **buffer)
+{
+    if (triple_id >= triple_count) {
+        return TRIPLE_FAILED;
+    }
+    MoyTriple *this_triple = triples + triple_id;
+    uint8_t result = TRIPLE_STALE;
+    if (this_triple->middle & TRIPLE_FRESH) {
+        uint32_t old = _moyAtomicExchange(&this_triple->middle, this_triple->front);
+        _moyMemoryBarrier();
+        this_triple->front = old & ~TRIPLE_FRESH;
+        this_triple->received = 1;
+        result = TRIPLE_OK;
+    } else if (!this_triple->received) {
+        return TRIPLE_EMPTY;
+    }
+    *buffer = this_triple->buffers + this_triple->front * this_triple->stride;
+    return result;
+}
+
+/*
+ * Create a stream of size bytes from the heap.
+ * Its reader is woken once trigger bytes are in, 1 for every write.
+ */
+uint8_t moyCreateStream(moy_size size, moy_size trigger, uint8_t *handle)
+{
+    if (size == 0) {
+        return STREAM_FAILED;
+    }
+    moyEnterCritical();
+    if (stream_count == MOY_STREAM_SIZE) {
+        moyLeaveCritical();
+        return STREAM_MAXIMUM_EXCEEDED;
+    }
+    uint8_t *buffer = moyMalloc(size);
+    if (buffer == 0) {
+        moyLeaveCritical();
+        return STREAM_MEM_POOL_FULL;
+    }
+    MoyStream *this_stream = streams + stream_count;
+    this_stream->buffer = buffer;
+    this_stream->size = size;
+    this_stream->head = 0;
+    this_stream->count = 0;
+    this_stream->trigger = 0;
+    this_stream->records = 0;
+    this_stream->readers.first = 0;
+    this_stream->writers.first = 0;
+    *handle = stream_count++;
+    moyLeaveCritical();
+    moyStreamSetTrigger(*handle, trigger);
+    return STREAM_OK;
+}
+
+/*
+ * Set the bytes a stream needs to wake its reader, within 1 and its size.
+ */
+uint8_t moyStreamSetTrigger(uint8_t stream_id, moy_size trigger)
+{
+    if (stream_id >= stream_count) {
+        return STREAM_FAILED;
+    }
+    MoyStream *this_stream = streams + stream_id;
+    if (trigger == 0) {
+        trigger = 1;
+    } else if (trigger > this_stream->size) {
+        trigger = this_stream->size;
+    }
+    moyEnterCritical();
+    this_stream->trigger = trigger;
+    if (this_stream->count >= trigger) {
+        WakeWaiter(&this_stream->readers);
+        Reschedule();
+    }
+    moyLeaveCritical();
+    return STREAM_OK;
+}
+
+/*
+ * Copy as many bytes as fit into a stream, in at most two pieces.
+ */
+static moy_size StreamPut(MoyStream *this_stream, const uint8_t *data, moy_size size)
+{
+    moy_size space = this_stream->size - this_stream->count;
+    if (size > space) {
+        size = space;
+    }
+    moy_size tail = this_stream->head + this_stream->count;
+    if (tail >= this_stream->size) {
+        tail -= this_stream->size;
+    }
+    moy_size first = this_stream->size - tail;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(this_stream->buffer + tail, data, first);
+    memcpy(this_stream->buffer, data + first, size - first);
+    this_stream->count += size;
+    return size;
+}
+
+/*
+ * Copy as many bytes as there are out of a stream, in at most two pieces.
+ */
+static moy_size StreamGet(MoyStream *this_stream, uint8_t *data, moy_size size)
+{
+    if (size > this_stream->count) {
+        size = this_stream->count;
+    }
+    moy_size first = this_stream->size - this_stream->head;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(data, this_stream->buffer + this_stream->head, first);
+    memcpy(data + first, this_stream->buffer, size - first);
+    this_stream->head += size;
+    if (this_stream->head >= this_stream->size) {
+        this_stream->head -= this_stream->size;
+    }
+    this_stream->count -= size;
+    return size;
+}
+
+/*
+ * Write bytes into a stream, waiting for room up to timeout in total.
+ * Safe to call from handlers, which never wait.
+ * Return the number of bytes written.
+ */
+moy_size moyStreamWrite(uint8_t stream_id, const void *data, moy_size size, moy_size timeout)
+{
+    if (stream_id >= stream_count || streams[stream_id].records) {
+        return 0;
+    }
+    MoyStream *this_stream = streams + stream_id;
+    moy_size done = 0;
+    moyEnterCritical();
+    for (;;) {
+        done += StreamPut(this_stream, (const uint8_t *)data + done, size - done);
+        if (this_stream->count >= this_stream->trigger) {
+            WakeWaiter(&this_stream->readers);
+        }
+        if (done == size || !timeout || _moyInHandler()) break;
+
+        /* Full, wait for the reader with the time left. */
+        BlockCurrent(TASK_BLOCKED_WRITING_STREAM, &this_stream->writers, timeout);
+        moyLeaveCritical();
+        _moyYield();
+        moyEnterCritical();
+        timeout = tasks[current_task].sleep_time;
+    }
+    Reschedule();
+    moyLeaveCritical();
+    return done;
+}
+
+/*
+ * Read up to size bytes from a stream.
+ * Wait up to timeout for the trigger level, then take what there is.
+ * Return the number of bytes read.
+ */
+moy_size moyStreamRead(uint8_t stream_id, void *data, moy_size size, moy_size timeout)
+{
+    if (stream_id >= stream_count || streams[stream_id].records) {
+        return 0;
+    }
+    MoyStream *this_stream = streams + stream_id;
+    moyEnterCritical();
+    while (this_stream->count < this_stream->trigger && timeout && !_moyInHandler()) {
+        BlockCurrent(TASK_BLOCKED_READING_STREAM, &this_stream->readers, timeout);
+        moyLeaveCritical();
+        _moyYield();
+        moyEnterCritical();
+        timeout = tasks[current_task].sleep_time;
+    }
+    moy_size done = StreamGet(this_stream, data, size);
+    if (done != 0) {
+        WakeWaiter(&this_stream->writers);
+        Reschedule();
+    }
+    moyLeaveCritical();
+    return done;
+}
+
+/*
+ * Create a buffer of size bytes for messages of any length.
+ * Each message takes its length in 2 bytes, then its bytes, packed in a
+ * ring like a stream. It is a stream handle, for the calls below only.
+ */
+uint8_t moyCreateMsgBuffer(moy_size size, uint8_t *handle)
+{
+    uint8_t result = moyCreateStream(size, 1, handle);
+    if (result == STREAM_OK) {
+        streams[*handle].records = 1;
+    }
+    return result;
+}
+
+/*
+ * Send a whole message, waiting up to timeout for room.
+ * Safe to call from handlers, which never wait.
+ */
+uint8_t moyMsgBufferSend(uint8_t buffer_id, const void *data, moy_size size, moy_size timeout)
+{
+    if (buffer_id >= stream_count || !streams[buffer_id].records
+            || size > 0xFFFF || size + 2 > streams[buffer_id].size) {
+        return STREAM_FAILED;
+    }
+    MoyStream *this_stream = streams + buffer_id;
+    uint16_t length = size;
+    moyEnterCritical();
+    while (this_stream->size - this_stream->count < size + 2) {
+        if (!timeout || _moyInHandler()) {
+            moyLeaveCritical();
+            return STREAM_FAILED;
+        }
+        BlockCurrent(TASK_BLOCKED_WRITING_STREAM, &this_stream->writers, timeout);
+        moyLeaveCritical();
+        _moyYield();
+        moyEnterCritical();
+        timeout = tasks[current_task].sleep_time;
+    }
+    StreamPut(this_stream, (const uint8_t *)&length, 2);
+    StreamPut(this_stream, data, size);
+    WakeWaiter(&this_stream->readers);
+    Reschedule();
+    moyLeaveCritical();
+    return STREAM_OK;
+}
+
+/*
+ * Receive the oldest message into data, waiting up to timeout for one,
+ * and get its length. Return STREAM_MSG_TOO_LONG if it is longer than
+ * size: it stays in the buffer, and length tells the room it needs.
+ */
+uint8_t moyMsgBufferReceive(
+        uint8_t buffer_id,
+        void *data,
+        moy_size size,
+        moy_size *length,
+        moy_size timeout
+)
+{
+    if (buffer_id >= stream_count || !streams[buffer_id].records) {
+        return STREAM_FAILED;
+    }
+    MoyStream *this_stream = streams + buffer_id;
+    moyEnterCritical();
+    while (this_stream->count == 0) {
+        if (!timeout || _moyInHandler()) {
+            moyLeaveCritical();
+            return STREAM_FAILED;
+        }
+        BlockCurrent(TASK_BLOCKED_READING_STREAM, &this_stream->readers, timeout);
+        moyLeaveCritical();
+        _moyYield();
+        moyEnterCritical();
+        timeout = tasks[current_task].sleep_time;
+    }
+
+    /* The length may wrap around the end of the ring too. */
+    uint16_t record_length;
+    uint8_t *bytes = (uint8_t *)&record_length;
+    moy_size second = this_stream->head + 1;
+    if (second == this_stream->size) {
+        second = 0;
+    }
+    bytes[0] = this_stream->buffer[this_stream->head];
+    bytes[1] = this_stream->buffer[second];
+    *length = record_length;
+    if (record_length > size) {
+        moyLeaveCritical();
+        return STREAM_MSG_TOO_LONG;
+    }
+    StreamGet(this_stream, bytes, 2);
+    StreamGet(this_stream, data, record_length);
+    WakeWaiter(&this_stream->writers);
+    Reschedule();
+    moyLeaveCritical();
+    return STREAM_OK;
+}
+
+/*
+ * Create an endpoint for servers to take calls at.
+ */
+uint8_t moyCreateEndpoint(uint8_t *handle)
+{
+    moyEnterCritical();
+    if (endpoint_count == MOY_ENDPOINT_SIZE) {
+        moyLeaveCritical();
+        return RPC_MAXIMUM_EXCEEDED;
+    }
+    endpoints[endpoint_count].senders.first = 0;
+    endpoints[endpoint_count].receivers.first = 0;
+    *handle = endpoint_count++;
+    moyLeaveCritical();
+    return RPC_OK;
+}
+
+/*
+ * Let the server of a call run at the priority of its caller, if higher.
+ */
+static void LendPriority(moy_task server, moy_task client)
+{
+    tasks[server].lent_priority = tasks[client].priority;
+    UpdatePriority(server);
+}
+
+/*
+ * Send a message to the server of an endpoint and wait for its reply.
+ * A server waiting in moyReceive is switched to at once, with the
+ * caller's priority and time slice. The timeout covers the whole call,
+ * so 0 fails at once.
+ */
+uint8_t moyCall(uint8_t endpoint_id, moy_size message, moy_size *reply, moy_size timeout)
+{
+    if (endpoint_id >= endpoint_count || !timeout || _moyInHandler()) {
+        return RPC_FAILED;
+    }
+    MoyTCB *this_task = tasks + current_task;
+    MoyEndpoint *this_endpoint = endpoints + endpoint_id;
+    moyEnterCritical();
+    moy_task server = FirstWaiter(&this_endpoint->receivers);
+    if (server != NO_TASK) {
+        /* Hand the message over and run the server next. */
+        tasks[server].message = message;
+        tasks[server].caller = current_task;
+        this_task->server = server;
+        BlockCurrent(TASK_BLOCKED_REPLY, 0, timeout);
+        MakeReady(server);
+        LendPriority(server, current_task);
+        tasks[server].slice_left = this_task->slice_left;
+        direct_task = server;
+    } else {
+        this_task->message = message;
+        this_task->server = NO_TASK;
+        BlockCurrent(TASK_BLOCKED_SENDING, &this_endpoint->senders, timeout);
+    }
+    moyLeaveCritical();
+    _moyYield();
+
+    /* Woken by the reply, or timed out with no time left. */
+    moyEnterCritical();
+    if (this_task->sleep_time == 0) {
+        /* A late reply to this call is refused. */
+        this_task->server = NO_TASK;
+        moyLeaveCritical();
+        return RPC_FAILED;
+    }
+    *reply = this_task->message;
+    moyLeaveCritical();
+    return RPC_OK;
+}
 
 /*
- * Allocate a stack from pool.
+ * Take a call from an endpoint, switching to task next if it has to wait.
+ * A priority lent by an earlier caller is given back before waiting.
  */
-moy_size* _moyAllocStack(uint32_t stack_size)
+static uint8_t Receive(
+        uint8_t endpoint_id,
+        moy_size *message,
+        moy_task *client,
+        moy_size timeout,
+        moy_task next
+)
 {
+    MoyTCB *this_task = tasks + current_task;
+    MoyEndpoint *this_endpoint = endpoints + endpoint_id;
     moyEnterCritical();
-    /* Check if pool is full. */
-    if (pool_count + stack_size >= MOY_POOL_SIZE) {
-        return 0;
+
+    /* A caller already waits, take the most urgent one's message. */
+    moy_task caller = FirstWaiter(&this_endpoint->senders);
+    if (caller != NO_TASK) {
+        WaitRemove(caller);
+        tasks[caller].status = TASK_BLOCKED_REPLY;
+        tasks[caller].server = current_task;
+        *message = tasks[caller].message;
+        *client = caller;
+        LendPriority(current_task, caller);
+        Reschedule();
+        moyLeaveCritical();
+        return RPC_OK;
+    }
+
+    if (!timeout) {
+        Reschedule();
+        moyLeaveCritical();
+        return RPC_FAILED;
+    }
+    this_task->lent_priority = 0;
+    UpdatePriority(current_task);
+    direct_task = next;
+    BlockCurrent(TASK_BLOCKED_RECEIVING, &this_endpoint->receivers, timeout);
+    moyLeaveCritical();
+    _moyYield();
+
+    /* Handed a call by moyCall, or timed out with no time left. */
+    moyEnterCritical();
+    if (this_task->sleep_time == 0) {
+        moyLeaveCritical();
+        return RPC_FAILED;
     }
-    pool_count += stack_size;
+    *message = this_task->message;
+    *client = this_task->caller;
     moyLeaveCritical();
-    return (moy_size*)(pool + pool_count);
+    return RPC_OK;
 }
 
 /*
- * Start everything.
+ * Take a call from an endpoint, then serve it and moyReply to client.
+ * Until then the server runs at least at the priority of the client.
+ * Set timeout to 0 for no waiting.
  */
-void moyStart()
+uint8_t moyReceive(uint8_t endpoint_id, moy_size *message, moy_task *client, moy_size timeout)
 {
-    /* Start the idle task. */
-    uint8_t result;
-    result = moyCreateTask((TaskFunction) _moyIdleTask, "idle", 24, 0, 0, &idle_task_id);
-    if (result != TASK_OK) {
-        return;
+    if (endpoint_id >= endpoint_count || _moyInHandler()) {
+        return RPC_FAILED;
     }
-
-    /* Start the OS */
-    _moyInitTicker();
-    _moySyscall(SYSCALL_START_OS, 0, 0, 0);
+    return Receive(endpoint_id, message, client, timeout, NO_TASK);
 }
 
 /*
- * Check OS Status.
+ * Drop a lent priority and wake a client with its reply.
+ * Called in the critical section. Return 0 if the client gave up, or
+ * waits on a call this task did not take.
  */
-uint8_t moyIsRunning()
+static uint8_t ReplyTo(moy_task client, moy_size reply)
 {
-    return started;
+    tasks[current_task].lent_priority = 0;
+    UpdatePriority(current_task);
+    if (client >= task_count || tasks[client].status != TASK_BLOCKED_REPLY
+            || tasks[client].server != current_task) {
+        return 0;
+    }
+    tasks[client].server = NO_TASK;
+    tasks[client].message = reply;
+    MakeReady(client);
+    direct_task = client;
+    return 1;
 }
 
 /*
- * Sleep a time.
+ * Reply to the client of a call, switching straight back to it unless
+ * the server has the higher priority.
+ * Fail if the client gave up, or waits on a call taken by another task.
  */
-void moyDelay(moy_size sleep_time)
+uint8_t moyReply(moy_task client, moy_size reply)
 {
-    _moySyscall(SYSCALL_TASK_SLEEP, sleep_time, current_task, 0);
-    _moyYield();
+    if (_moyInHandler()) {
+        return RPC_FAILED;
+    }
+    moyEnterCritical();
+    uint8_t replied = ReplyTo(client, reply);
+    if (replied && tasks[client].priority >= tasks[current_task].priority) {
+        tasks[client].slice_left = tasks[current_task].slice_left;
+        _moyYield();
+    } else {
+        Reschedule();
+    }
+    moyLeaveCritical();
+    return replied ? RPC_OK : RPC_FAILED;
 }
 
 /*
- * Create a task, and get a handler to operate it.
- * Return a status code.
- * Priority should be over 0 except the idle task.
+ * Reply to a client, then take the next call, with one switch when the
+ * server has to wait. Fail as moyReply does without taking a call if
+ * the reply is refused.
  */
-uint8_t moyCreateTask(
-        TaskFunction entry,
-        const char *name,
-        moy_size stack_size,
-        void *parameters,
-        uint8_t priority,
-        uint8_t *handler
+uint8_t moyReplyWait(
+        moy_task client,
+        moy_size reply,
+        uint8_t endpoint_id,
+        moy_size *message,
+        moy_task *next_client,
+        moy_size timeout
 )
 {
+    if (endpoint_id >= endpoint_count || _moyInHandler()) {
+        return RPC_FAILED;
+    }
     moyEnterCritical();
-    /* Check if reaching maximum task number */
-    if (task_count == MOY_TASK_SIZE) {
+    if (!ReplyTo(client, reply)) {
+        Reschedule();
         moyLeaveCritical();
-        return TASK_MAXIMUM_EXCEEDED;
+        return RPC_FAILED;
     }
-    /* Check if pool is full */
-    void *stack_bottom = _moyAllocStack(stack_size);
-    if (stack_bottom == 0) {
+    moyLeaveCritical();
+    return Receive(endpoint_id, message, next_client, timeout, client);
+}
+
+/*
+ * Create a mutex. Its owner runs at least at the priority of the most
+ * urgent task waiting for it.
+ */
+uint8_t moyCreateMutex(uint8_t *handle)
+{
+    moyEnterCritical();
+    if (mutex_count == MOY_MUTEX_SIZE) {
         moyLeaveCritical();
-        return TASK_MEM_POOL_FULL;
-    }
-    /* Set handler */
-    if (handler != 0) {
-        *handler = task_count;
-    }
-    /* Init TCB */
-    MoyTCB *this_task = tasks + task_count++;
-    this_task->stack_size = stack_size;
-    this_task->priority = priority;
-    this_task->status = TASK_READY;
-    this_task->stack_bottom = (moy_size)stack_bottom;
-    _moyInitFrame(this_task, entry, parameters);
-    if (name != 0) {
-        strcpy(this_task->name, name);
+        return MUTEX_MAXIMUM_EXCEEDED;
     }
+    mutexes[mutex_count].owner = NO_TASK;
+    mutexes[mutex_count].waiters.first = 0;
+    *handle = mutex_count++;
     moyLeaveCritical();
-    return TASK_OK;
+    return MUTEX_OK;
 }
 
 /*
- * Del current task.
+ * Lock a mutex, waiting up to timeout. It can't be locked twice.
+ * Set timeout to 0 for no waiting.
  */
-void moyDelTask()
+uint8_t moyMutexLock(uint8_t mutex_id, moy_size timeout)
 {
-    if (!started) return;
-    moyDelTaskByID(current_task);
+    if (mutex_id >= mutex_count || _moyInHandler()) {
+        return MUTEX_FAILED;
+    }
+    MoyMutex *this_mutex = mutexes + mutex_id;
+    moyEnterCritical();
+    if (this_mutex->owner == NO_TASK) {
+        this_mutex->owner = current_task;
+        moyLeaveCritical();
+        return MUTEX_OK;
+    }
+    if (this_mutex->owner == current_task || !timeout) {
+        moyLeaveCritical();
+        return MUTEX_FAILED;
+    }
+
+    /* Lend the owner our priority while waiting. */
+    BlockCurrent(TASK_BLOCKED_MUTEX, &this_mutex->waiters, timeout);
+    UpdatePriority(this_mutex->owner);
+    moyLeaveCritical();
     _moyYield();
+
+    /* Handed the mutex by moyMutexUnlock, or timed out. */
+    moyEnterCritical();
+    if (this_mutex->owner == current_task) {
+        moyLeaveCritical();
+        return MUTEX_OK;
+    }
+    UpdatePriority(this_mutex->owner);
+    Reschedule();
+    moyLeaveCritical();
+    return MUTEX_FAILED;
 }
 
 /*
- * Del a task by ID.
+ * Unlock a mutex held by the current task.
  */
-void moyDelTaskByID(uint8_t handler)
+uint8_t moyMutexUnlock(uint8_t mutex_id)
 {
-    tasks[handler].status = 0;
+    if (mutex_id >= mutex_count) {
+        return MUTEX_FAILED;
+    }
+    MoyMutex *this_mutex = mutexes + mutex_id;
+    moyEnterCritical();
+    if (this_mutex->owner != current_task || _moyInHandler()) {
+        moyLeaveCritical();
+        return MUTEX_FAILED;
+    }
+    MutexRelease(this_mutex);
+    UpdatePriority(current_task);
+    Reschedule();
+    moyLeaveCritical();
+    return MUTEX_OK;
 }
 
 /*
- * Find the next task to execute.
+ * Create a condition variable, waited on with a mutex held.
  */
-static inline MoyTCB* FindAvaTask()
+uint8_t moyCreateCond(uint8_t *handle)
 {
     moyEnterCritical();
-    uint8_t this_task_id = current_task;
-
-    /* Idle task as default. */
-    uint8_t next_task_id = idle_task_id;
-    uint8_t highest_priority = 0;
-    uint8_t i = task_count;
-
-    while (i--) {
-        this_task_id++;
-        if (this_task_id >= task_count) this_task_id = 0;
+    if (cond_count == MOY_COND_SIZE) {
+        moyLeaveCritical();
+        return COND_MAXIMUM_EXCEEDED;
+    }
+    conds[cond_count].waiters.first = 0;
+    *handle = cond_count++;
+    moyLeaveCritical();
+    return COND_OK;
+}
 
-        MoyTCB *this_task = tasks + this_task_id;
+/*
+ * Unlock a mutex and wait for a signal, as one step, then lock it again.
+ * The mutex is held on return, even if the wait timed out.
+ * Return COND_FAILED on timeout, or if the mutex was not held.
+ */
+uint8_t moyCondWait(uint8_t cond_id, uint8_t mutex_id, moy_size timeout)
+{
+    if (cond_id >= cond_count || mutex_id >= mutex_count || _moyInHandler()) {
+        return COND_FAILED;
+    }
+    MoyMutex *this_mutex = mutexes + mutex_id;
+    moyEnterCritical();
+    if (this_mutex->owner != current_task) {
+        moyLeaveCritical();
+        return COND_FAILED;
+    }
+    MutexRelease(this_mutex);
+    UpdatePriority(current_task);
+    uint8_t signaled = 0;
+    if (timeout) {
+        BlockCurrent(TASK_BLOCKED_COND, &conds[cond_id].waiters, timeout);
+        moyLeaveCritical();
+        _moyYield();
+        moyEnterCritical();
+        signaled = tasks[current_task].sleep_time != 0;
+    }
+    moyLeaveCritical();
 
-        /* Check queues if awaiting. */
-        if (this_task->status | TASK_BLOCKED_READING_QUEUE) {
-            if (queues[this_task->waiting].status == QUEUE_FILLED) {
-                this_task->status = TASK_READY;
-            }
-        }
-        if (this_task->status | TASK_BLOCKED_WRITING_QUEUE) {
-            if (queues[this_task->waiting].status == QUEUE_EMPTY) {
-                this_task->status = TASK_READY;
-            }
-        }
+    while (moyMutexLock(mutex_id, (moy_size)-1) != MUTEX_OK);
+    return signaled ? COND_OK : COND_FAILED;
+}
 
-        /* Check if executable */
-        if (this_task->status == TASK_READY
-                && this_task->priority > highest_priority) {
-            next_task_id = this_task_id;
-            highest_priority = this_task->priority;
-        }
+/*
+ * Wake the most urgent task waiting on a condition variable.
+ * Safe to call from handlers.
+ */
+uint8_t moyCondSignal(uint8_t cond_id)
+{
+    if (cond_id >= cond_count) {
+        return COND_FAILED;
     }
-
-    current_task = next_task_id;
+    moyEnterCritical();
+    WakeWaiter(&conds[cond_id].waiters);
+    Reschedule();
     moyLeaveCritical();
-    return tasks + next_task_id;
+    return COND_OK;
 }
 
 /*
- * Should be called every tick.
- * Deal with sleep and block.
+ * Wake every task waiting on a condition variable.
+ * Safe to call from handlers.
  */
-void _moyTick()
+uint8_t moyCondBroadcast(uint8_t cond_id)
 {
+    if (cond_id >= cond_count) {
+        return COND_FAILED;
+    }
     moyEnterCritical();
-    int i;
-    for (i = 0; i < task_count; ++i) {
-        MoyTCB *this_task = tasks + i;
-        /* Deal with waiting */
-        if (this_task->status &
-                (TASK_DELAYED | TASK_BLOCKED_READING_QUEUE | TASK_BLOCKED_WRITING_QUEUE)) {
-            if (this_task->sleep_time <= MOY_SWITCH_INTERVAL) {
-                this_task->status = TASK_READY;
-            } else {
-                this_task->sleep_time -= MOY_SWITCH_INTERVAL;
-            }
-        }
+    while (conds[cond_id].waiters.first != 0) {
+        WakeWaiter(&conds[cond_id].waiters);
     }
+    Reschedule();
     moyLeaveCritical();
+    return COND_OK;
 }
 
 /*
- * Should be called when switch occurs.
- * Save the stack top and return the next stack top.
+ * Create a reader-writer lock. Once a writer waits, no more readers get
+ * in, so writers are never starved.
  */
-moy_size _moySwitch(moy_size stack_top)
+uint8_t moyCreateRwLock(uint8_t *handle)
 {
-    /* Update the stack top */
-    tasks[current_task].stack_top = stack_top;
+    moyEnterCritical();
+    if (rwlock_count == MOY_RWLOCK_SIZE) {
+        moyLeaveCritical();
+        return RWLOCK_MAXIMUM_EXCEEDED;
+    }
+    MoyRwLock *this_lock = rwlocks + rwlock_count;
+    this_lock->writer = NO_TASK;
+    this_lock->readers = 0;
+    this_lock->writers_waiting.first = 0;
+    this_lock->readers_waiting.first = 0;
+    *handle = rwlock_count++;
+    moyLeaveCritical();
+    return RWLOCK_OK;
+}
 
-    MoyTCB *next_task = FindAvaTask();
+/*
+ * Wait for a reader-writer lock, in the list of readers or writers.
+ * Called and returns in the critical section. Return 0 on timeout.
+ */
+static uint8_t RwLockWait(MoyRwLock *this_lock, MoyWaitList *list, moy_size timeout)
+{
+    if (!timeout) {
+        return 0;
+    }
+    BlockCurrent(TASK_BLOCKED_RWLOCK, list, timeout);
+    UpdateHolders(TASK_BLOCKED_RWLOCK, list, MOY_MUTEX_SIZE + MOY_RWLOCK_SIZE);
+    moyLeaveCritical();
+    _moyYield();
 
-    return next_task->stack_top;
+    /* Granted by RwLockGrant, or timed out with no time left. */
+    moyEnterCritical();
+    if (tasks[current_task].sleep_time != 0) {
+        return 1;
+    }
+    UpdateHolders(TASK_BLOCKED_RWLOCK, list, MOY_MUTEX_SIZE + MOY_RWLOCK_SIZE);
+    /* Readers held back by a writer that gave up may go. */
+    RwLockGrant(this_lock);
+    Reschedule();
+    return 0;
 }
 
 /*
- * Create a queue.
+ * Lock a reader-writer lock to read, along with other readers.
+ * A task holds it once, to read or to write.
+ * Set timeout to 0 for no waiting.
  */
-uint8_t moyCreateQueue(uint8_t *handle)
+uint8_t moyRwLockRead(uint8_t rwlock_id, moy_size timeout)
 {
+    if (rwlock_id >= rwlock_count || _moyInHandler()) {
+        return RWLOCK_FAILED;
+    }
+    MoyRwLock *this_lock = rwlocks + rwlock_id;
+    MoyTCB *this_task = tasks + current_task;
     moyEnterCritical();
-    if (queue_count == MOY_QUEUE_SIZE) {
+    if (this_lock->writer == current_task || (this_task->read_held & (1u << rwlock_id))) {
         moyLeaveCritical();
-        return QUEUE_MAXIMUM_EXCEEDED;
+        return RWLOCK_FAILED;
     }
-    queues[queue_count].status = QUEUE_EMPTY;
-    *handle = queue_count++;
+    if (this_lock->writer == NO_TASK && this_lock->writers_waiting.first == 0) {
+        this_lock->readers++;
+        this_task->read_held |= 1u << rwlock_id;
+        moyLeaveCritical();
+        return RWLOCK_OK;
+    }
+    uint8_t granted = RwLockWait(this_lock, &this_lock->readers_waiting, timeout);
     moyLeaveCritical();
-    return QUEUE_OK;
+    return granted ? RWLOCK_OK : RWLOCK_FAILED;
 }
 
 /*
- * Push an item into a queue.
+ * Lock a reader-writer lock to write, alone.
  * Set timeout to 0 for no waiting.
  */
-uint8_t moyQueuePush(uint8_t queue_id, moy_size item, moy_size timeout)
+uint8_t moyRwLockWrite(uint8_t rwlock_id, moy_size timeout)
 {
-    MoyQueue *this_queue = queues + queue_id;
+    if (rwlock_id >= rwlock_count || _moyInHandler()) {
+        return RWLOCK_FAILED;
+    }
+    MoyRwLock *this_lock = rwlocks + rwlock_id;
     moyEnterCritical();
-
-    /* If empty, just write and return. */
-    if (this_queue->status == QUEUE_EMPTY) {
-        this_queue->item_ptr = item;
-        this_queue->status = QUEUE_FILLED;
+    if (this_lock->writer == current_task
+            || (tasks[current_task].read_held & (1u << rwlock_id))) {
         moyLeaveCritical();
-        return QUEUE_OK;
+        return RWLOCK_FAILED;
     }
-
-    /* Not empty, wait or fail. */
-    if (!timeout) {
+    if (this_lock->writer == NO_TASK && this_lock->readers == 0) {
+        this_lock->writer = current_task;
         moyLeaveCritical();
-        return QUEUE_FAILED;
+        return RWLOCK_OK;
     }
-    MoyTCB *this_task = tasks + current_task;
-    this_task->status = TASK_BLOCKED_WRITING_QUEUE;
-    this_task->waiting = queue_id;
-    this_task->sleep_time = timeout;
+    uint8_t granted = RwLockWait(this_lock, &this_lock->writers_waiting, timeout);
     moyLeaveCritical();
-    _moyYield();
+    return granted ? RWLOCK_OK : RWLOCK_FAILED;
+}
 
-    /* Now the block has been removed. Let's check the queue. */
+/*
+ * Unlock a reader-writer lock the current task holds to read or to write.
+ */
+uint8_t moyRwUnlock(uint8_t rwlock_id)
+{
+    if (rwlock_id >= rwlock_count || _moyInHandler()) {
+        return RWLOCK_FAILED;
+    }
+    MoyRwLock *this_lock = rwlocks + rwlock_id;
     moyEnterCritical();
-    if (this_queue->status == QUEUE_EMPTY) {
-        this_queue->item_ptr = item;
-        this_queue->status = QUEUE_FILLED;
+    if (this_lock->writer == current_task) {
+        this_lock->writer = NO_TASK;
+        UpdatePriority(current_task);
+    } else if (tasks[current_task].read_held & (1u << rwlock_id)) {
+        tasks[current_task].read_held &= ~(1u << rwlock_id);
+        this_lock->readers--;
+        UpdatePriority(current_task);
+    } else {
         moyLeaveCritical();
-        return QUEUE_OK;
+        return RWLOCK_FAILED;
     }
+    RwLockGrant(this_lock);
+    Reschedule();
     moyLeaveCritical();
-    return QUEUE_FAILED;
+    return RWLOCK_OK;
 }
 
+#if MOY_DMA_CHANNEL_SIZE
 /*
- * Pull an item from a queue.
- * Set timeout to 0 for no waiting.
+ * Hand the next chunk of a copy to its channel.
  */
-uint8_t moyQueuePull(uint8_t queue_id, moy_size *item_ptr, moy_size timeout)
+static void CopyNextChunk(uint8_t channel)
 {
-    MoyQueue *this_queue = queues + queue_id;
-    moyEnterCritical();
+    MoyCopy *this_copy = copies + channel;
+    moy_size taken = _moyDmaStart(channel, this_copy->dst, this_copy->src, this_copy->left);
+    this_copy->dst += taken;
+    this_copy->src += taken;
+    this_copy->left -= taken;
+}
+#endif
 
-    /* If empty, just write and return. */
-    if (this_queue->status == QUEUE_FILLED) {
-        *item_ptr = this_queue->item_ptr;
-        this_queue->status = QUEUE_EMPTY;
+/*
+ * Copy memory in the background on a DMA channel.
+ * Small copies, and copies finding every channel busy, are done at once
+ * with memcpy and get MOY_COPY_SYNC as handle.
+ * With a handle, moyCopyWait must collect the copy before the channel is
+ * reused. Without one, the channel is freed as soon as it is done.
+ */
+uint8_t moyCopyAsync(void *dst, const void *src, moy_size size, uint8_t *handle)
+{
+#if MOY_DMA_CHANNEL_SIZE
+    if (size >= MOY_COPY_THRESHOLD) {
+        moyEnterCritical();
+        uint8_t i;
+        for (i = 0; i < MOY_DMA_CHANNEL_SIZE; ++i) {
+            if (copies[i].status == COPY_IDLE) {
+                MoyCopy *this_copy = copies + i;
+                this_copy->status = COPY_RUNNING;
+                this_copy->owned = handle != 0;
+                this_copy->dst = dst;
+                this_copy->src = src;
+                this_copy->left = size;
+                CopyNextChunk(i);
+                if (handle != 0) {
+                    *handle = i;
+                }
+                moyLeaveCritical();
+                return COPY_OK;
+            }
+        }
         moyLeaveCritical();
-        return QUEUE_OK;
     }
+#endif
+    memcpy(dst, src, size);
+    if (handle != 0) {
+        *handle = MOY_COPY_SYNC;
+    }
+    return COPY_OK;
+}
 
-    /* Not empty, wait or fail. */
-    if (!timeout) {
+/*
+ * Wait for a copy to finish and free its channel.
+ * Set timeout to 0 for no waiting. Return COPY_BUSY if still running.
+ */
+uint8_t moyCopyWait(uint8_t handle, moy_size timeout)
+{
+    if (handle == MOY_COPY_SYNC) {
+        return COPY_OK;
+    }
+#if MOY_DMA_CHANNEL_SIZE
+    if (handle >= MOY_DMA_CHANNEL_SIZE) {
+        return COPY_FAILED;
+    }
+    MoyCopy *this_copy = copies + handle;
+    moyEnterCritical();
+    if (!this_copy->owned) {
         moyLeaveCritical();
-        return QUEUE_FAILED;
+        return COPY_FAILED;
     }
-    MoyTCB *this_task = tasks + current_task;
-    this_task->status = TASK_BLOCKED_READING_QUEUE;
-    this_task->waiting = queue_id;
-    this_task->sleep_time = timeout;
+
+    /* Still running, wait or fail. Handlers can't wait. */
+    if (this_copy->status == COPY_RUNNING) {
+        if (!timeout || _moyInHandler()) {
+            moyLeaveCritical();
+            return COPY_BUSY;
+        }
+        BlockCurrent(TASK_BLOCKED_COPY, &this_copy->waiter, timeout);
+        moyLeaveCritical();
+        _moyYield();
+
+        /* Woken by the channel or timed out. */
+        moyEnterCritical();
+        if (this_copy->status == COPY_RUNNING) {
+            moyLeaveCritical();
+            return COPY_BUSY;
+        }
+    }
+
+    uint8_t result = this_copy->status == COPY_FINISHED ? COPY_OK : COPY_FAILED;
+    this_copy->status = COPY_IDLE;
+    this_copy->owned = 0;
     moyLeaveCritical();
-    _moyYield();
+    return result;
+#else
+    return COPY_FAILED;
+#endif
+}
 
-    /* Now the block has been removed. Let's check the queue. */
+/*
+ * Called by the port when a DMA channel stops.
+ * Queue the next chunk, or finish the copy and wake its waiter.
+ */
+void _moyCopyDone(uint8_t channel, uint8_t ok)
+{
+#if MOY_DMA_CHANNEL_SIZE
+    MoyCopy *this_copy = copies + channel;
     moyEnterCritical();
-    if (this_queue->status == QUEUE_FILLED) {
-        *item_ptr = this_queue->item_ptr;
-        this_queue->status = QUEUE_EMPTY;
+    if (ok && this_copy->left != 0) {
+        CopyNextChunk(channel);
         moyLeaveCritical();
-        return QUEUE_OK;
+        return;
+    }
+    if (!this_copy->owned) {
+        this_copy->status = COPY_IDLE;
+    } else {
+        this_copy->status = ok ? COPY_FINISHED : COPY_ERROR;
+        WakeWaiter(&this_copy->waiter);
+        Reschedule();
     }
     moyLeaveCritical();
-    return QUEUE_FAILED;
+#endif
+}
+
+/*
+ * Return to a job preempted on the job stack.
+ */
+static inline moy_size _moySvcDoJobResume(moy_size stack_top)
+{
+    job_resume_top = stack_top;
+    _moyYield();
+    return SYSCALL_OK;
 }
 
 /*
@@ -321,8 +3199,9 @@ uint8_t moyQueuePull(uint8_t queue_id, moy_size *item_ptr, moy_size timeout)
 static inline moy_size _moySvcDoTaskSleep(moy_size sleep_time)
 {
     moyEnterCritical();
+    ReadyRemove(current_task);
     tasks[current_task].sleep_time = sleep_time;
-    tasks[current_task].status |= TASK_DELAYED;
+    tasks[current_task].status = TASK_DELAYED;
     moyLeaveCritical();
     return SYSCALL_OK;
 }
@@ -354,6 +3233,8 @@ moy_size _moySvcHandler(moy_size arg1, moy_size arg2, moy_size arg3, moy_size ar
             return _moySvcDoStartOS();
         case SYSCALL_TASK_SLEEP:
             return _moySvcDoTaskSleep(arg2);
+        case SYSCALL_JOB_RESUME:
+            return _moySvcDoJobResume(arg2);
         default:
             return SYSCALL_UNDEFINED;
     }
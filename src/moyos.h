@@ -7,11 +7,50 @@
 #ifndef MOYOS_H
 #define MOYOS_H
 
+/* Another configuration or port, such as the simulator, may be chosen at build time. */
+#ifdef MOY_CONFIG_HEADER
+#include MOY_CONFIG_HEADER
+#else
 #include "config.h"
+#endif
+#include "static_objects.h"
 
 typedef void(*TaskFunction)(void *);
 
+#ifdef MOY_PORT_HEADER
+#include MOY_PORT_HEADER
+#else
 #include "port.h"
+#endif
+
+/* Trace hooks, which a port may define to watch the scheduler. */
+#ifndef MOY_TRACE_READY
+#define MOY_TRACE_READY(task_id)
+#endif
+
+#ifndef MOY_TRACE_RUN
+#define MOY_TRACE_RUN(task_id)
+#endif
+
+#if MOY_PRIORITY_SIZE > 32
+#error "MOY_PRIORITY_SIZE should be no more than 32"
+#endif
+
+#if MOY_EDF_PRIORITY == 0 || MOY_EDF_PRIORITY >= MOY_PRIORITY_SIZE
+#error "MOY_EDF_PRIORITY should be between 1 and MOY_PRIORITY_SIZE - 1"
+#endif
+
+#if MOY_JOB_PRIORITY == MOY_EDF_PRIORITY || MOY_JOB_PRIORITY >= MOY_PRIORITY_SIZE
+#error "MOY_JOB_PRIORITY should be a fixed priority level"
+#endif
+
+#if MOY_RWLOCK_SIZE > 32
+#error "MOY_RWLOCK_SIZE should be no more than 32"
+#endif
+
+#if MOY_JOB_LEVEL_SIZE > 31
+#error "MOY_JOB_LEVEL_SIZE should be no more than 31"
+#endif
 
 
 /* Task Status Masks */
@@ -19,6 +58,60 @@ typedef void(*TaskFunction)(void *);
 #define TASK_DELAYED (1 << 1)
 #define TASK_BLOCKED_READING_QUEUE (1 << 2)
 #define TASK_BLOCKED_WRITING_QUEUE (1 << 3)
+#define TASK_SUSPENDED (1 << 4)
+#define TASK_BLOCKED_COPY (1 << 5)
+#define TASK_DELAYED_PRECISE (1 << 6)
+#define TASK_BLOCKED_MSG_ALLOC (1 << 7)
+#define TASK_BLOCKED_READING_STREAM (1 << 8)
+#define TASK_BLOCKED_WRITING_STREAM (1 << 9)
+#define TASK_BLOCKED_SENDING (1 << 10)
+#define TASK_BLOCKED_REPLY (1 << 11)
+#define TASK_BLOCKED_RECEIVING (1 << 12)
+#define TASK_BLOCKED_MUTEX (1 << 13)
+#define TASK_BLOCKED_COND (1 << 14)
+#define TASK_BLOCKED_RWLOCK (1 << 15)
+
+/* Waits ended by a timeout */
+#define TASK_TIMED_WAITS (TASK_DELAYED | TASK_BLOCKED_READING_QUEUE \
+        | TASK_BLOCKED_WRITING_QUEUE | TASK_BLOCKED_COPY | TASK_BLOCKED_MSG_ALLOC \
+        | TASK_BLOCKED_READING_STREAM | TASK_BLOCKED_WRITING_STREAM \
+        | TASK_BLOCKED_SENDING | TASK_BLOCKED_REPLY | TASK_BLOCKED_RECEIVING \
+        | TASK_BLOCKED_MUTEX | TASK_BLOCKED_COND | TASK_BLOCKED_RWLOCK)
+
+/* Task handle, wide enough to index every task slot */
+#if MOY_TASK_SIZE < 192
+typedef uint8_t moy_task;
+#else
+typedef uint16_t moy_task;
+#endif
+
+/* Placeholder for No Task */
+#define NO_TASK ((moy_task)-1)
+
+/* Placeholder for No Job */
+#define NO_JOB ((uint8_t)-1)
+
+/* Handle of a copy finished before moyCopyAsync returned */
+#define MOY_COPY_SYNC ((uint8_t)-1)
+
+/* Pattern painted over fresh stacks. */
+#define MOY_STACK_PAINT 0xA5A5A5A5
+
+
+/* Handlers of Static Objects */
+
+#define MOY_STATIC_TASK_ID(name, entry, parameters, stack_size, priority) MOY_TASK_##name,
+enum STATIC_TASK {
+    MOY_TASK_IDLE,
+    MOY_STATIC_TASKS(MOY_STATIC_TASK_ID)
+    MOY_STATIC_TASK_COUNT
+};
+
+#define MOY_STATIC_QUEUE_ID(name) MOY_QUEUE_##name,
+enum STATIC_QUEUE {
+    MOY_STATIC_QUEUES(MOY_STATIC_QUEUE_ID)
+    MOY_STATIC_QUEUE_COUNT
+};
 
 
 /* Code Definitions */
@@ -30,15 +123,59 @@ enum RETURN_CODE {
     TASK_OK,
     TASK_MAXIMUM_EXCEEDED,
     TASK_MEM_POOL_FULL,
+    TASK_INVALID,
     QUEUE_OK,
     QUEUE_MAXIMUM_EXCEEDED,
-    QUEUE_FAILED
+    QUEUE_FAILED,
+    QUEUE_MEM_POOL_FULL,
+    JOB_OK,
+    JOB_MAXIMUM_EXCEEDED,
+    JOB_FAILED,
+    COPY_OK,
+    COPY_BUSY,
+    COPY_FAILED,
+    MSG_OK,
+    MSG_MAXIMUM_EXCEEDED,
+    MSG_MEM_POOL_FULL,
+    MSG_FAILED,
+    STREAM_OK,
+    STREAM_MAXIMUM_EXCEEDED,
+    STREAM_MEM_POOL_FULL,
+    STREAM_FAILED,
+    STREAM_MSG_TOO_LONG,
+    TOPIC_OK,
+    TOPIC_MAXIMUM_EXCEEDED,
+    TOPIC_FAILED,
+    MAILBOX_OK,
+    MAILBOX_MAXIMUM_EXCEEDED,
+    MAILBOX_MEM_POOL_FULL,
+    MAILBOX_EMPTY,
+    MAILBOX_FAILED,
+    TRIPLE_OK,
+    TRIPLE_MAXIMUM_EXCEEDED,
+    TRIPLE_MEM_POOL_FULL,
+    TRIPLE_STALE,
+    TRIPLE_EMPTY,
+    TRIPLE_FAILED,
+    RPC_OK,
+    RPC_MAXIMUM_EXCEEDED,
+    RPC_FAILED,
+    MUTEX_OK,
+    MUTEX_MAXIMUM_EXCEEDED,
+    MUTEX_FAILED,
+    COND_OK,
+    COND_MAXIMUM_EXCEEDED,
+    COND_FAILED,
+    RWLOCK_OK,
+    RWLOCK_MAXIMUM_EXCEEDED,
+    RWLOCK_FAILED
 };
 
 enum CALL_CODE {
     SYSCALL_START_OS,
     SYSCALL_TASK_SLEEP,
     SYSCALL_SWITCH_CONTEXT,
+    SYSCALL_JOB_RESUME,
     SYSCALL_FATAL_ERROR
 };
 
@@ -47,15 +184,60 @@ enum QUEUE_CODE {
     QUEUE_FILLED
 };
 
+enum TOPIC_CODE {
+    TOPIC_DROP_NEWEST,
+    TOPIC_DROP_OLDEST
+};
+
+enum COPY_CODE {
+    COPY_IDLE,
+    COPY_RUNNING,
+    COPY_FINISHED,
+    COPY_ERROR
+};
+
 
 /* OS Structs */
 
+typedef struct {
+    moy_size jobs;                  /* jobs finished */
+    moy_size deadline_misses;       /* jobs finished after their deadline */
+    moy_size overruns;              /* jobs running past the next release */
+    moy_size last_response;         /* response time of the last job (ticks) */
+    moy_size worst_response;        /* worst response time seen (ticks) */
+} MoyJobStats;
+
+/* Tasks blocked on an object, by priority then arrival, through next and prev. */
+typedef struct {
+    moy_task first;                 /* first to wake (handle + 1), 0 if none */
+} MoyWaitList;
+
 typedef struct {
     char name[MOY_TASK_NAME_SIZE];  /* task name for debug */
-    uint8_t status;                 /* task status */
-    uint8_t priority;               /* task priority */
-    uint8_t waiting;                /* id of queue waited for */
+    uint16_t status;                /* task status */
+    uint8_t priority;               /* task priority, maybe lent or inherited */
+    uint8_t base_priority;          /* priority of its own */
+    uint8_t lent_priority;          /* priority lent by a caller, 0 if none */
+    MoyWaitList *wait_list;         /* list blocked in, 0 if none */
+    moy_task next;                  /* next task in ready or wait list */
+    moy_task prev;                  /* previous task in ready or wait list */
     moy_size sleep_time;            /* remaining sleep time */
+    moy_size wake_at;               /* end of a moyDelayUs (us) */
+    moy_size message;               /* request, then reply, of a call */
+    moy_task caller;                /* caller handed to a receiving server */
+    moy_task server;                /* server that took its call, NO_TASK if none */
+    uint32_t read_held;             /* reader-writer locks held to read, a bit each */
+    moy_size time_slice;            /* ticks to run before rotation */
+    moy_size slice_left;            /* ticks left in current slice */
+    moy_size deadline;              /* relative deadline of a job (ticks) */
+    moy_size period;                /* release period (ticks) */
+    moy_size release;               /* release time of current job */
+    moy_size abs_deadline;          /* absolute deadline of current job */
+    moy_size lent_deadline;         /* earlier deadline inherited in the EDF level */
+    uint8_t deadline_lent;          /* 1 if lent_deadline orders it, not abs_deadline */
+    TaskFunction job_entry;         /* job of a periodic task */
+    void *job_arg;                  /* parameters of the job */
+    MoyJobStats stats;              /* timing of finished jobs */
     moy_size stack_size;            /* size of stack */
     moy_size stack_top;             /* top of task stack */
     moy_size stack_bottom;          /* bottom of task stack */
@@ -64,9 +246,112 @@ typedef struct {
 
 typedef struct {
     uint8_t status;
+    uint8_t irq_task;               /* IRQ task to pend on push (handle + 1) */
     moy_size item_ptr;
+    uint8_t *slots;                 /* ring of a slot queue, 0 for one item */
+    moy_size slot_stride;           /* bytes from one slot to the next */
+    moy_size depth;                 /* number of slots */
+    moy_size head;                  /* oldest committed slot */
+    moy_size count;                 /* committed slots */
+    uint8_t reserved;               /* the slot behind the last is being written */
+    uint8_t peeked;                 /* the oldest slot is being read */
+    MoyWaitList readers;            /* tasks waiting for an item */
+    MoyWaitList writers;            /* tasks waiting for room */
 } MoyQueue;
 
+typedef struct {
+    TaskFunction entry;             /* run to completion on each interrupt */
+    void *parameters;               /* passed to entry */
+    uint8_t irq;                    /* interrupt line bound to */
+} MoyIrqTask;
+
+typedef struct {
+    uint8_t status;
+    uint8_t owned;                  /* someone holds the handle and will wait */
+    uint8_t *dst;                   /* where the next chunk goes */
+    const uint8_t *src;             /* where the next chunk comes from */
+    moy_size left;                  /* bytes not yet handed to the channel */
+    MoyWaitList waiter;             /* task in moyCopyWait */
+} MoyCopy;
+
+/* Placed before each message buffer. */
+typedef struct MoyMsgHeader {
+    struct MoyMsgHeader *next;      /* next free buffer of the pool */
+    uint16_t pool;                  /* pool id + 1 while allocated, 0 when free */
+    uint16_t refs;                  /* holders, each to free it once */
+} MoyMsgHeader;
+
+typedef struct {
+    MoyMsgHeader *free_head;        /* first free buffer */
+    uint8_t *storage;               /* buffers with their headers */
+    moy_size stride;                /* bytes from one header to the next */
+    moy_size count;                 /* number of buffers */
+    moy_size free_count;            /* buffers not allocated */
+    MoyWaitList waiters;            /* tasks waiting for a buffer */
+} MoyMsgPool;
+
+typedef struct {
+    uint8_t queues[MOY_TOPIC_SUBSCRIBER_SIZE];  /* slot queue of each subscriber */
+    uint8_t policies[MOY_TOPIC_SUBSCRIBER_SIZE];  /* what a full queue drops */
+    uint8_t subscriber_count;
+    moy_size drops;                 /* deliveries dropped on full queues */
+} MoyTopic;
+
+typedef struct {
+    volatile moy_size sequence;     /* twice the writes begun, plus one mid-write */
+    uint8_t *copies;                /* two copies of the value, back to back */
+    moy_size size;                  /* bytes of the value */
+} MoyMailbox;
+
+typedef struct {
+    volatile uint32_t middle;       /* buffer between the sides, with the fresh flag */
+    uint8_t *buffers;               /* three buffers, back to back */
+    moy_size stride;                /* bytes from one buffer to the next */
+    uint8_t back;                   /* buffer of the producer */
+    uint8_t front;                  /* buffer of the consumer */
+    uint8_t received;               /* the consumer got a buffer once */
+} MoyTriple;
+
+typedef struct {
+    moy_task owner;                 /* task holding it, NO_TASK if free */
+    MoyWaitList waiters;            /* tasks waiting to lock it */
+} MoyMutex;
+
+typedef struct {
+    MoyWaitList waiters;            /* tasks waiting for a signal */
+} MoyCond;
+
+typedef struct {
+    moy_task writer;                /* task holding it to write, NO_TASK if none */
+    moy_size readers;               /* tasks holding it to read */
+    MoyWaitList writers_waiting;    /* tasks waiting to write */
+    MoyWaitList readers_waiting;    /* tasks waiting to read */
+} MoyRwLock;
+
+typedef struct {
+    MoyWaitList senders;            /* callers not taken yet */
+    MoyWaitList receivers;          /* servers waiting in moyReceive */
+} MoyEndpoint;
+
+typedef struct {
+    uint8_t *buffer;                /* ring of bytes */
+    moy_size size;                  /* bytes in the ring */
+    moy_size head;                  /* oldest byte */
+    moy_size count;                 /* bytes written and not read */
+    moy_size trigger;               /* bytes to wake the reader */
+    uint8_t records;                /* holds length-prefixed messages */
+    MoyWaitList readers;            /* tasks waiting for bytes */
+    MoyWaitList writers;            /* tasks waiting for room */
+} MoyStream;
+
+typedef struct {
+    TaskFunction entry;             /* run to completion on each activation */
+    void *parameters;               /* passed to entry */
+    uint8_t level;                  /* preemption level */
+    uint8_t pending;                /* activations not yet run */
+    uint8_t next;                   /* next pending job of the same level */
+} MoyJob;
+
 
 /* OS Commands */
 
@@ -78,6 +363,14 @@ void moyEnterCritical();
 
 void moyLeaveCritical();
 
+/* Time Commands */
+
+moy_size moyGetTicks();
+
+uint64_t moyNowCycles();
+
+uint64_t moyNowUs();
+
 
 /* Task Commands */
 
@@ -87,15 +380,69 @@ uint8_t moyCreateTask(
         moy_size stack_size,
         void *parameters,
         uint8_t priority,
-        uint8_t *handler
+        moy_task *handler
+);
+
+uint8_t moyCreateEdfTask(
+        TaskFunction entry,
+        const char *name,
+        moy_size stack_size,
+        void *parameters,
+        moy_size deadline,
+        moy_size period,
+        moy_task *handler
+);
+
+void moyWaitPeriod();
+
+uint8_t moyCreatePeriodicTask(
+        TaskFunction entry,
+        const char *name,
+        moy_size stack_size,
+        void *parameters,
+        uint8_t priority,
+        moy_size period,
+        moy_size deadline,
+        moy_size phase,
+        moy_task *handler
 );
 
+uint8_t moyGetJobStats(moy_task handler, MoyJobStats *stats);
+
+moy_size moyGetStackHighWater(moy_task handler);
+
+void moyStackOverflowHook(moy_task handler);
+
 void moyDelTask();
 
-void moyDelTaskByID(uint8_t handler);
+void moyDelTaskByID(moy_task handler);
 
 void moyDelay(moy_size sleep_time);
 
+void moyDelayUs(moy_size us);
+
+void moyYield();
+
+uint8_t moySetTimeSlice(moy_task handler, moy_size time_slice);
+
+uint8_t moySetPriority(moy_task handler, uint8_t priority);
+
+uint8_t moySuspend(moy_task handler);
+
+uint8_t moyResume(moy_task handler);
+
+/* IRQ Task Commands */
+
+uint8_t moyCreateIrqTask(
+        TaskFunction entry,
+        void *parameters,
+        uint8_t irq,
+        uint8_t priority,
+        uint8_t *handle
+);
+
+uint8_t moyPendIrqTask(uint8_t handle);
+
 /* Queue Commands */
 
 uint8_t moyCreateQueue(uint8_t *handle);
@@ -104,6 +451,147 @@ uint8_t moyQueuePush(uint8_t queue_id, moy_size item, moy_size timeout);
 
 uint8_t moyQueuePull(uint8_t queue_id, moy_size *item_ptr, moy_size timeout);
 
+uint8_t moyQueueBindIrqTask(uint8_t queue_id, uint8_t handle);
+
+uint8_t moyCreateSlotQueue(moy_size slot_size, moy_size depth, uint8_t *handle);
+
+uint8_t moyQueueReserve(uint8_t queue_id, void **slot, moy_size timeout);
+
+uint8_t moyQueueCommit(uint8_t queue_id);
+
+uint8_t moyQueuePeekSlot(uint8_t queue_id, void **slot, moy_size timeout);
+
+uint8_t moyQueueRelease(uint8_t queue_id);
+
+/* Message Commands */
+
+uint8_t moyCreateMsgPool(moy_size msg_size, moy_size count, uint8_t *handle);
+
+uint8_t moyMsgAlloc(uint8_t pool_id, void **msg, moy_size timeout);
+
+uint8_t moyMsgFree(void *msg);
+
+uint8_t moyMsgSend(uint8_t queue_id, void *msg, moy_size timeout);
+
+uint8_t moyMsgReceive(uint8_t queue_id, void **msg, moy_size timeout);
+
+/* Topic Commands */
+
+uint8_t moyCreateTopic(uint8_t *handle);
+
+uint8_t moySubscribe(uint8_t topic_id, moy_size depth, uint8_t policy, uint8_t *queue_handle);
+
+uint8_t moyPublish(uint8_t topic_id, void *msg);
+
+uint8_t moyTopicReceive(uint8_t queue_id, void **msg, moy_size timeout);
+
+/* Mailbox Commands */
+
+uint8_t moyCreateMailbox(moy_size size, uint8_t *handle);
+
+uint8_t moyMailboxWrite(uint8_t mailbox_id, const void *data);
+
+uint8_t moyMailboxRead(uint8_t mailbox_id, void *data, moy_size *version);
+
+/* Triple Buffer Commands */
+
+uint8_t moyCreateTripleBuffer(moy_size size, uint8_t *handle);
+
+void *moyTripleBack(uint8_t triple_id);
+
+uint8_t moyTriplePublish(uint8_t triple_id);
+
+uint8_t moyTripleLatest(uint8_t triple_id, void **buffer);
+
+/* Stream Commands */
+
+uint8_t moyCreateStream(moy_size size, moy_size trigger, uint8_t *handle);
+
+uint8_t moyStreamSetTrigger(uint8_t stream_id, moy_size trigger);
+
+moy_size moyStreamWrite(uint8_t stream_id, const void *data, moy_size size, moy_size timeout);
+
+moy_size moyStreamRead(uint8_t stream_id, void *data, moy_size size, moy_size timeout);
+
+uint8_t moyCreateMsgBuffer(moy_size size, uint8_t *handle);
+
+uint8_t moyMsgBufferSend(uint8_t buffer_id, const void *data, moy_size size, moy_size timeout);
+
+uint8_t moyMsgBufferReceive(
+        uint8_t buffer_id,
+        void *data,
+        moy_size size,
+        moy_size *length,
+        moy_size timeout
+);
+
+/* Call Commands */
+
+uint8_t moyCreateEndpoint(uint8_t *handle);
+
+uint8_t moyCall(uint8_t endpoint_id, moy_size message, moy_size *reply, moy_size timeout);
+
+uint8_t moyReceive(uint8_t endpoint_id, moy_size *message, moy_task *client, moy_size timeout);
+
+uint8_t moyReply(moy_task client, moy_size reply);
+
+uint8_t moyReplyWait(
+        moy_task client,
+        moy_size reply,
+        uint8_t endpoint_id,
+        moy_size *message,
+        moy_task *next_client,
+        moy_size timeout
+);
+
+/* Lock Commands */
+
+uint8_t moyCreateMutex(uint8_t *handle);
+
+uint8_t moyMutexLock(uint8_t mutex_id, moy_size timeout);
+
+uint8_t moyMutexUnlock(uint8_t mutex_id);
+
+uint8_t moyCreateCond(uint8_t *handle);
+
+uint8_t moyCondWait(uint8_t cond_id, uint8_t mutex_id, moy_size timeout);
+
+uint8_t moyCondSignal(uint8_t cond_id);
+
+uint8_t moyCondBroadcast(uint8_t cond_id);
+
+uint8_t moyCreateRwLock(uint8_t *handle);
+
+uint8_t moyRwLockRead(uint8_t rwlock_id, moy_size timeout);
+
+uint8_t moyRwLockWrite(uint8_t rwlock_id, moy_size timeout);
+
+uint8_t moyRwUnlock(uint8_t rwlock_id);
+
+/* Job Commands */
+
+uint8_t moyCreateJob(TaskFunction entry, void *parameters, uint8_t level, uint8_t *handle);
+
+uint8_t moyActivateJob(uint8_t job_id);
+
+uint8_t moySrpLock(uint8_t ceiling);
+
+void moySrpUnlock(uint8_t previous);
+
+/* Copy Commands */
+
+uint8_t moyCopyAsync(void *dst, const void *src, moy_size size, uint8_t *handle);
+
+uint8_t moyCopyWait(uint8_t handle, moy_size timeout);
+
+/* Memory Commands */
+
+void *moyMalloc(moy_size size);
+
+void moyFree(void *ptr);
+
+moy_size moyHeapUsed();
+
 /* Callees. */
 
 moy_size _moySwitch(moy_size stack_top);
@@ -114,6 +602,12 @@ void _moyYield();
 
 void _moyTick();
 
+void _moyIrqTaskRun(uint8_t irq);
+
+void _moyCopyDone(uint8_t channel, uint8_t ok);
+
+void _moyTimerExpired();
+
 
 
 /*
@@ -132,6 +626,33 @@ void _moyInit();
 /* Do device-related init work. */
 void _moyInitFrame(MoyTCB *task, TaskFunction entry, void *arg);
 
+/* Make a task call entry(arg) when resumed, above its saved context. */
+void _moyInjectCall(MoyTCB *task, TaskFunction entry, void *arg);
+
+/* Check if running in an interrupt handler. */
+uint8_t _moyInHandler();
+
+/* Check if an interrupt line is already enabled by someone else. */
+uint8_t _moyIrqInUse(uint8_t irq);
+
+/* Route an interrupt line to _moyIrqTaskRun at an IRQ task priority. */
+void _moyBindIrq(uint8_t irq, uint8_t priority);
+
+/* Set an interrupt line pending. */
+void _moyPendIrq(uint8_t irq);
+
+/* Start copying up to size bytes on a DMA channel, return bytes taken. */
+moy_size _moyDmaStart(uint8_t channel, void *dst, const void *src, moy_size size);
+
+/* Store a word and return the one it replaces, as one atomic access. */
+uint32_t _moyAtomicExchange(volatile uint32_t *word, uint32_t value);
+
+/* Microseconds on the precise timer, read with interrupts off. */
+moy_size _moyTimerNow();
+
+/* Call _moyTimerExpired at some time on the precise timer, or soon after. */
+void _moyTimerSet(moy_size at);
+
 /* Initialize the ticker. */
 void _moyInitTicker();
 
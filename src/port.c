@@ -95,6 +95,89 @@ moy_size _moySyscall(moy_size arg1, moy_size arg2, moy_size arg3, moy_size arg4)
     return result;
 }
 
+/*
+ * Exchange with LDREX and STREX, tried again if anything came between.
+ */
+uint32_t _moyAtomicExchange(volatile uint32_t *word, uint32_t value)
+{
+    uint32_t old;
+    uint32_t failed;
+    do {
+        __asm volatile ("ldrex %0, [%1]" : "=r" (old) : "r" (word) : "memory");
+        __asm volatile ("strex %0, %2, [%1]" : "=&r" (failed) : "r" (word), "r" (value) : "memory");
+    } while (failed);
+    return old;
+}
+
+#if MOY_PRECISE_TIMER
+/* Overflows of TIM2, the high half of the microsecond count. */
+static volatile uint32_t timer_high = 0;
+
+/*
+ * Run TIM2 at 1 MHz, free-running over 16 bits, extended by its overflows.
+ * Its interrupt sits above IRQ tasks, so that wake-ups are on time.
+ */
+static void InitPreciseTimer()
+{
+    RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+    /* The timer runs at the core clock with the usual APB1 settings. */
+    TIM2->PSC = SystemCoreClock / 1000000 - 1;
+    TIM2->ARR = 0xFFFF;
+    TIM2->EGR = TIM_EGR_UG;
+    TIM2->SR = 0;
+    TIM2->DIER = TIM_DIER_UIE;
+    TIM2->CR1 = TIM_CR1_CEN;
+    NVIC_SetPriority(TIM2_IRQn, NVIC_EncodePriority(0, 2, 0));
+    NVIC_EnableIRQ(TIM2_IRQn);
+}
+
+/*
+ * Defined by CMSIS, on TIM2 overflow and compare match.
+ */
+void TIM2_IRQHandler(void)
+{
+    uint16_t status = TIM2->SR;
+    if (status & TIM_SR_UIF) {
+        TIM2->SR = ~TIM_SR_UIF;
+        timer_high++;
+    }
+    if (status & TIM_SR_CC1IF) {
+        TIM2->SR = ~TIM_SR_CC1IF;
+        TIM2->DIER &= ~TIM_DIER_CC1IE;
+    }
+    /* Also pended by _moyTimerSet for times already passed. */
+    _moyTimerExpired();
+}
+
+/*
+ * Microseconds on TIM2. An overflow not handled yet is counted in.
+ */
+moy_size _moyTimerNow()
+{
+    uint32_t high = timer_high;
+    uint16_t low = TIM2->CNT;
+    if ((TIM2->SR & TIM_SR_UIF) && low < 0x8000) {
+        high++;
+    }
+    return (high << 16) | low;
+}
+
+/*
+ * Match the low half of a time on channel 1. Times further away than an
+ * overflow match early, and _moyTimerExpired sets the timer again.
+ */
+void _moyTimerSet(moy_size at)
+{
+    TIM2->CCR1 = (uint16_t)at;
+    TIM2->SR = ~TIM_SR_CC1IF;
+    TIM2->DIER |= TIM_DIER_CC1IE;
+    /* Too close to be matched after the write, take it now. */
+    if ((int32_t)(at - _moyTimerNow()) <= 1) {
+        NVIC_SetPendingIRQ(TIM2_IRQn);
+    }
+}
+#endif
+
 /*
  * Initialize the ticker, required by OS.
  */
@@ -106,7 +189,12 @@ void _moyInitTicker()
     NVIC_SetPriorityGrouping(0);
     NVIC_SetPriority(SysTick_IRQn, NVIC_EncodePriority(0, 0, 0));
     NVIC_SetPriority(SVCall_IRQn, NVIC_EncodePriority(0, 1, 0));
-    NVIC_SetPriority(PendSV_IRQn, NVIC_EncodePriority(0, 2, 0));
+    /* PendSV must be the lowest, so that it never switches under a handler. */
+    NVIC_SetPriority(PendSV_IRQn, NVIC_EncodePriority(0, 15, 0));
+
+#if MOY_PRECISE_TIMER
+    InitPreciseTimer();
+#endif
 }
 
 /*
@@ -158,6 +246,11 @@ void _moyInit()
 {
     /* Initialize the hardware. */
     SystemInit();
+
+    /* Start the cycle counter of the DWT. */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    *(volatile uint32_t *)0xE0001004 = 0;
+    *(volatile uint32_t *)0xE0001000 |= 1;
 }
 
 /*
@@ -172,4 +265,145 @@ void _moyInitFrame(MoyTCB *task, TaskFunction entry, void *arg)
     frame->lr = (uint32_t)moyDelTask;
     frame->psr = 0x21000000;
     task->stack_top = task->stack_bottom - sizeof(uint32_t) * 16;
-}
\ No newline at end of file
+}
+
+/*
+ * Stack a frame calling entry(arg) above the saved context of a task.
+ * The call must not return, as there is nothing to return to.
+ * The exception return expects the frame 8-byte aligned, as its psr
+ * doesn't set STKALIGN to say a padding word is there, so the stack is
+ * rounded down first. The words skipped are dropped along with the
+ * frame when the saved context is resumed.
+ */
+void _moyInjectCall(MoyTCB *task, TaskFunction entry, void *arg)
+{
+    moy_size top = task->stack_top & ~(moy_size)7;
+    AutoFrame* frame = (AutoFrame*)(top - sizeof(AutoFrame));
+    frame->r0 = (uint32_t)arg;
+    frame->pc = (uint32_t)entry;
+    frame->lr = 0;
+    frame->psr = 0x21000000;
+    task->stack_top = top - sizeof(uint32_t) * 16;
+}
+
+/*
+ * Check if running in an interrupt handler.
+ */
+uint8_t _moyInHandler()
+{
+    return (SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk) != 0;
+}
+
+/* Vector table copied to RAM once IRQ tasks or DMA copies are bound. */
+static uint32_t vectors[16 + MOY_IRQ_LINE_SIZE] __attribute__((aligned(256)));
+static uint8_t vectors_in_ram = 0;
+
+/*
+ * Move the vector table to RAM, so that handlers can be set at run time.
+ */
+static void VectorsToRam()
+{
+    if (vectors_in_ram) return;
+    uint32_t *flash_vectors = (uint32_t *)SCB->VTOR;
+    uint32_t i;
+    for (i = 0; i < 16 + MOY_IRQ_LINE_SIZE; ++i) {
+        vectors[i] = flash_vectors[i];
+    }
+    SCB->VTOR = (uint32_t)vectors;
+    vectors_in_ram = 1;
+}
+
+/*
+ * Shared handler of all lines bound to IRQ tasks.
+ */
+static void IrqTaskHandler(void)
+{
+    _moyIrqTaskRun((SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk) - 16);
+}
+
+/*
+ * Check if an interrupt line is already enabled by someone else.
+ */
+uint8_t _moyIrqInUse(uint8_t irq)
+{
+    return (NVIC->ISER[irq >> 5] & (1u << (irq & 0x1F))) != 0;
+}
+
+/*
+ * Route an interrupt line to the IRQ task handler.
+ * Priority 1 maps to NVIC priority 14, the highest to 3, just below SVCall.
+ */
+void _moyBindIrq(uint8_t irq, uint8_t priority)
+{
+    VectorsToRam();
+    vectors[16 + irq] = (uint32_t)IrqTaskHandler;
+    NVIC_SetPriority((IRQn_Type)irq, NVIC_EncodePriority(0, 15 - priority, 0));
+    NVIC_EnableIRQ((IRQn_Type)irq);
+}
+
+/*
+ * Set an interrupt line pending.
+ */
+void _moyPendIrq(uint8_t irq)
+{
+    NVIC_SetPendingIRQ((IRQn_Type)irq);
+}
+
+/* DMA1 channels, indexed from 0. */
+static DMA_Channel_TypeDef *const dma_channels[7] = {
+    DMA1_Channel1, DMA1_Channel2, DMA1_Channel3, DMA1_Channel4,
+    DMA1_Channel5, DMA1_Channel6, DMA1_Channel7
+};
+static uint8_t dma_bound = 0;
+
+/*
+ * Shared handler of the DMA1 channels used for copies.
+ */
+static void DmaCopyHandler(void)
+{
+    uint8_t line = (SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk) - 16 - DMA1_Channel1_IRQn;
+    uint32_t flags = DMA1->ISR >> (4 * line);
+    DMA1->IFCR = DMA_IFCR_CGIF1 << (4 * line);
+    dma_channels[line]->CCR = 0;
+    _moyCopyDone(line - (MOY_DMA_FIRST_CHANNEL - 1), !(flags & DMA_ISR_TEIF1));
+}
+
+/*
+ * Start a memory to memory transfer on a DMA channel.
+ * Units are as wide as the alignment of both ends and the size allows,
+ * and at most 65535 of them go in one transfer.
+ */
+moy_size _moyDmaStart(uint8_t channel, void *dst, const void *src, moy_size size)
+{
+    uint8_t line = MOY_DMA_FIRST_CHANNEL - 1 + channel;
+    DMA_Channel_TypeDef *dma = dma_channels[line];
+
+    if (!dma_bound) {
+        RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+        VectorsToRam();
+        uint8_t i;
+        for (i = 0; i < MOY_DMA_CHANNEL_SIZE; ++i) {
+            IRQn_Type irq = (IRQn_Type)(DMA1_Channel1_IRQn + MOY_DMA_FIRST_CHANNEL - 1 + i);
+            vectors[16 + irq] = (uint32_t)DmaCopyHandler;
+            NVIC_SetPriority(irq, NVIC_EncodePriority(0, 14, 0));
+            NVIC_EnableIRQ(irq);
+        }
+        dma_bound = 1;
+    }
+
+    uint32_t bits = (uint32_t)dst | (uint32_t)src | size;
+    uint8_t width = (bits & 3) == 0 ? 2 : (bits & 1) == 0 ? 1 : 0;
+    moy_size count = size >> width;
+    if (count > 0xFFFF) {
+        count = 0xFFFF;
+    }
+
+    /* In memory to memory mode the "peripheral" side is read. */
+    dma->CCR = 0;
+    dma->CPAR = (uint32_t)src;
+    dma->CMAR = (uint32_t)dst;
+    dma->CNDTR = count;
+    dma->CCR = DMA_CCR1_MEM2MEM | DMA_CCR1_PINC | DMA_CCR1_MINC
+            | (width << 8) | (width << 10) | DMA_CCR1_TCIE | DMA_CCR1_TEIE | DMA_CCR1_EN;
+    return count << width;
+}
@@ -14,6 +14,41 @@
 /* size_t should be defined as "moy_size" */
 typedef uint32_t moy_size;
 
+/* Number of device interrupt lines. */
+#define MOY_IRQ_LINE_SIZE 43
+
+/* Number of IRQ task priorities, between SVCall and PendSV. */
+#define MOY_IRQ_PRIORITY_SIZE 12
+
+/*
+ * DMA1 channels lent to moyCopyAsync, MOY_DMA_CHANNEL_SIZE of them from
+ * MOY_DMA_FIRST_CHANNEL on. A port without DMA sets the size to 0.
+ */
+#define MOY_DMA_FIRST_CHANNEL 6
+#define MOY_DMA_CHANNEL_SIZE 2
+
+/* Count leading zeros of a non-zero word, a single CLZ on Cortex-M3. */
+#define _moyClz(x) ((uint8_t)__builtin_clz(x))
+
+/* Order memory accesses on both sides, for the compiler as well. */
+#define _moyMemoryBarrier() __asm volatile ("dmb" ::: "memory")
+
+/* Free-running 32-bit cycle counter, DWT CYCCNT, and its frequency. */
+#define _moyCycleCount() (*(volatile uint32_t *)0xE0001004)
+#define _moyCycleFrequency() (SystemCoreClock)
+
+/*
+ * Initializer of a static stack: painted, with the first frame built
+ * the same way as _moyInitFrame does.
+ */
+#define MOY_STACK_INIT(stack_size, entry, parameters) { \
+    [0 ... (stack_size) - 9] = MOY_STACK_PAINT, \
+    [(stack_size) - 8] = (moy_size)(parameters), \
+    [(stack_size) - 3] = (moy_size)moyDelTask, \
+    [(stack_size) - 2] = (moy_size)(entry), \
+    [(stack_size) - 1] = 0x21000000 \
+}
+
 /* For using stored registers in stack. */
 typedef struct {
     /* Saved by program manually */
@@ -0,0 +1,28 @@
+/*
+ * static_objects.h @ MoyOS
+ *
+ * Tasks and queues set up at compile time.
+ *
+ * Their TCBs and stacks, with the first frame already built, are placed in
+ * .data by the linker, so nothing is allocated at runtime and running out
+ * of RAM fails the link instead of moyCreateTask.
+ * Each gets a constant handler, MOY_TASK_<name> or MOY_QUEUE_<name>.
+ *
+ * Example:
+ *   #define MOY_STATIC_TASKS(TASK) \
+ *       TASK(logger, logger_main, 0, 128, 2) \
+ *       TASK(sensor, sensor_main, 0, 96, 3)
+ *   #define MOY_STATIC_QUEUES(QUEUE) \
+ *       QUEUE(samples)
+ *
+ */
+#ifndef MOYOS_STATIC_OBJECTS_H
+#define MOYOS_STATIC_OBJECTS_H
+
+/* TASK(name, entry, parameters, stack_size, priority) */
+#define MOY_STATIC_TASKS(TASK)
+
+/* QUEUE(name) */
+#define MOY_STATIC_QUEUES(QUEUE)
+
+#endif //MOYOS_STATIC_OBJECTS_H
@@ -10,6 +10,14 @@
 #include <time.h>
 #include <stdlib.h>
 
+/* Stack sizes, unless measured by make stack-sizes. */
+#ifndef MOY_STACK_OAK
+#define MOY_STACK_OAK 500
+#endif
+#ifndef MOY_STACK_NUT
+#define MOY_STACK_NUT 500
+#endif
+
 void test1(uint8_t queue_id)
 {
     int count = 0;
@@ -63,8 +71,8 @@ void user_main()
     uint8_t queue;
     moyCreateQueue(&queue);
 
-    moyCreateTask((TaskFunction)test1, 0, 500, queue, 1, 0);
-    moyCreateTask((TaskFunction)test2, 0, 500, queue, 1, 0);
+    moyCreateTask((TaskFunction)test1, "oak", MOY_STACK_OAK, queue, 1, 0);
+    moyCreateTask((TaskFunction)test2, "nut", MOY_STACK_NUT, queue, 1, 0);
 
     moyStart();
 }
\ No newline at end of file
@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# stack_sizer.py @ MoyOS
+#
+# Run a firmware image under QEMU, read how much of each task stack was
+# touched, and emit a header of stack sizes with a safety margin.
+#
+# Stacks are painted by moyCreateTask, so the high-water mark of a task is
+# the part of its stack no longer holding the paint pattern. The target is
+# left running for a while, then halted through the QEMU gdb stub and read
+# with gdb.
+#
+# Usage:
+#   make
+#   python3 tools/stack_sizer.py --elf build/moyos.elf --seconds 20 \
+#       --out src/stack_sizes.h
+#
+# Once src/stack_sizes.h exists, make builds with MOY_STACK_SIZES and
+# config.h includes it: MOY_STACK_JOBS sizes the job host, and task code
+# can pass MOY_STACK_<NAME> to moyCreateTask. Stacks not taken from the
+# pool, like the idle task's, are left out of the header and the saving.
+#
+import argparse
+import math
+import re
+import subprocess
+import sys
+import time
+
+STACK_PAINT = 0xA5A5A5A5
+
+DEFAULT_QEMU = ("qemu-system-gnuarmeclipse --board OLIMEX-STM32-H103 "
+                "--image {elf} --nographic --gdb tcp::{port} "
+                "--semihosting-config enable=on,target=native")
+
+
+def gdb_batch(gdb, elf, port, commands):
+    """Attach to the QEMU gdb stub, run some commands and return stdout."""
+    args = [gdb, "-batch", "-nx", "-ex", "target remote :%d" % port]
+    for command in commands:
+        args += ["-ex", command]
+    args.append(elf)
+    result = subprocess.run(args, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    if result.returncode != 0:
+        sys.exit("gdb failed:\n" + result.stderr)
+    return result.stdout
+
+
+def read_tasks(gdb, elf, port):
+    """Return (name, size, used, bottom) for every live task."""
+    out = gdb_batch(gdb, elf, port, [
+        'printf "COUNT %u\\n", task_count',
+    ])
+    count = int(re.search(r"COUNT (\d+)", out).group(1))
+
+    commands = []
+    for i in range(count):
+        commands.append(
+            'printf "TASK %%d|%%s|%%u|%%u|%%u\\n", %d, tasks[%d].name, '
+            'tasks[%d].status, tasks[%d].stack_size, tasks[%d].stack_bottom'
+            % (i, i, i, i, i))
+    out = gdb_batch(gdb, elf, port, commands)
+
+    live = []
+    for match in re.finditer(r"TASK (\d+)\|(.*)\|(\d+)\|(\d+)\|(\d+)", out):
+        index, name, status, size, bottom = match.groups()
+        if int(status) == 0 or int(size) == 0:
+            continue
+        live.append((int(index), name, int(size), int(bottom)))
+
+    tasks = []
+    for index, name, size, bottom in live:
+        start = bottom - size * 4
+        out = gdb_batch(gdb, elf, port, ["x/%dwx 0x%x" % (size, start)])
+        words = []
+        for line in out.splitlines():
+            match = re.match(r"\s*0x[0-9a-fA-F]+(?: <[^>]*>)?:(.*)", line)
+            if match:
+                words += [int(w, 16) for w in match.group(1).split()]
+        untouched = 0
+        for word in words:
+            if word != STACK_PAINT:
+                break
+            untouched += 1
+        tasks.append((name or "task%d" % index, size, size - untouched, bottom))
+    return tasks
+
+
+def read_pool(gdb, elf, port):
+    """Return the address and size in words of the memory pool."""
+    out = gdb_batch(gdb, elf, port, [
+        "printf \"POOL %u|%u\\n\", &'heap.c'::pool, sizeof('heap.c'::pool) / 4",
+    ])
+    match = re.search(r"POOL (\d+)\|(\d+)", out)
+    return int(match.group(1)), int(match.group(2))
+
+
+def tune(used, margin, extra):
+    """Add the margin and round up to 8 words, the heap granularity."""
+    size = int(math.ceil(used * (1 + margin / 100.0))) + extra
+    return (size + 7) // 8 * 8
+
+
+def macro_name(name):
+    return "MOY_STACK_" + re.sub(r"[^A-Za-z0-9]", "_", name).upper()
+
+
+def emit_header(path, rows, pool_size, total_now, total_tuned):
+    lines = [
+        "/*",
+        " * %s @ MoyOS" % path.rsplit("/", 1)[-1],
+        " *",
+        " * Stack sizes measured by tools/stack_sizer.py, do not edit.",
+        " * Pool: %d words, stacks: %d words now, %d words tuned."
+        % (pool_size, total_now, total_tuned),
+        " *",
+        " */",
+        "#ifndef MOYOS_STACK_SIZES_H",
+        "#define MOYOS_STACK_SIZES_H",
+        "",
+    ]
+    for name, size, used, tuned in rows:
+        lines.append("/* %s: used %d of %d words */" % (name, used, size))
+        lines.append("#define %s %d" % (macro_name(name), tuned))
+        lines.append("")
+    lines.append("#endif //MOYOS_STACK_SIZES_H")
+    with open(path, "w") as header:
+        header.write("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure task stacks under QEMU and emit tuned sizes.")
+    parser.add_argument("--elf", default="build/moyos.elf")
+    parser.add_argument("--out", default="src/stack_sizes.h")
+    parser.add_argument("--seconds", type=float, default=10,
+                        help="how long to run the workload")
+    parser.add_argument("--margin", type=float, default=25,
+                        help="safety margin over the measured use, percent")
+    parser.add_argument("--extra", type=int, default=16,
+                        help="words added on top of the margin, for the "
+                             "exception frames an interrupt may push")
+    parser.add_argument("--port", type=int, default=1234)
+    parser.add_argument("--gdb", default="arm-none-eabi-gdb")
+    parser.add_argument("--qemu", default=DEFAULT_QEMU,
+                        help="QEMU command line, with {elf} and {port}")
+    args = parser.parse_args()
+
+    # exec, so that killing the shell stops QEMU itself.
+    command = "exec " + args.qemu.format(elf=args.elf, port=args.port)
+    qemu = subprocess.Popen(command, shell=True, stdout=subprocess.DEVNULL)
+    try:
+        time.sleep(args.seconds)
+        if qemu.poll() is not None:
+            sys.exit("QEMU exited early with code %d" % qemu.returncode)
+        tasks = read_tasks(args.gdb, args.elf, args.port)
+        pool_start, pool_size = read_pool(args.gdb, args.elf, args.port)
+    finally:
+        qemu.kill()
+        qemu.wait()
+
+    rows = []
+    pool_end = pool_start + pool_size * 4
+    for name, size, used, bottom in tasks:
+        if used == size:
+            print("warning: %s used its whole stack, it may have overflowed"
+                  % name, file=sys.stderr)
+        # Static stacks, like the idle task's, are sized in the source.
+        if not pool_start < bottom <= pool_end:
+            print("skipped %s, its stack is not in the pool" % name)
+            continue
+        rows.append((name, size, used, tune(used, args.margin, args.extra)))
+
+    total_now = sum(row[1] for row in rows)
+    total_tuned = sum(row[3] for row in rows)
+    emit_header(args.out, rows, pool_size, total_now, total_tuned)
+
+    print("%-12s %8s %8s %8s" % ("task", "size", "used", "tuned"))
+    for name, size, used, tuned in rows:
+        print("%-12s %8d %8d %8d" % (name, size, used, tuned))
+    saving = total_now - total_tuned
+    print("stacks: %d -> %d words, saving %d of %d pool words (%.1f%%)"
+          % (total_now, total_tuned, saving, pool_size,
+             100.0 * saving / pool_size))
+    print("wrote %s" % args.out)
+
+
+if __name__ == "__main__":
+    main()